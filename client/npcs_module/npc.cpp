@@ -44,10 +44,35 @@ npcs_module::npc::~npc() {
   }
 }
 
+void npcs_module::npc::set_skin(uint16_t model_id) {
+  if (!is_ped_valid())
+    return;
+
+  if (!is_ped_model(model_id)) {
+    model_id = MODEL_MALE01;
+  }
+  if (ped->m_nModelIndex == model_id) {
+    return;
+  }
+
+  // Ped keeps its tasks, weapons and position, only the model is swapped
+  request_model(model_id);
+  ped->DeleteRwObject();
+  ped->SetModelIndex(model_id);
+}
+
 void npcs_module::npc::set_stun_enabled(bool enabled) {
   stun_enabled = enabled;
 }
 
+void npcs_module::npc::set_sync_owner(bool owner) {
+  if (owner && !sync_owner) {
+    // Handoff: the new owner uploads right away, server has no sync source meanwhile
+    last_sync_send_check = std::chrono::steady_clock::time_point();
+  }
+  sync_owner = owner;
+}
+
 void npcs_module::npc::set_position(const CVector &position) {
   if (!is_ped_valid())
     return;
@@ -138,12 +163,23 @@ void npcs_module::npc::set_health(float health) {
                                     false);
     set_current_task(task);
   } else if (health > 0.f && get_active_task_type() == TASK_COMPLEX_DIE) {
-    // TODO: Reviving is not working
-    // TODO: Some changes applied to tasks setter, probably can work now
-    stand_still();
+    // Sync has come before the revive rpc
+    revive(health);
   }
 }
 
+void npcs_module::npc::revive(float health) {
+  if (!is_ped_valid())
+    return;
+
+  // Die task is dropped along with the others, the ped is teleported out of the death animation
+  clear_active_task(true);
+  ped->m_nPedState = PEDSTATE_IDLE;
+  ped->m_fHealth = health;
+  ped->m_fMaxHealth = std::max(health, ped->m_fMaxHealth);
+  stand_still();
+}
+
 void npcs_module::npc::put_in_vehicle(CVehicle *vehicle, int seat) {
   if (!is_ped_valid())
     return;
@@ -327,6 +363,8 @@ void npcs_module::npc::update() {
                                     false);
     set_current_task(task);
   }
+
+  update_sequence();
 }
 
 void npcs_module::npc::update_from_sync(const npc_sync_receive_data_t &data) {
@@ -385,32 +423,13 @@ void npcs_module::npc::update_from_sync(const npc_sync_receive_data_t &data) {
 bool npcs_module::npc::send_sync_if_required() {
   if (!is_ped_valid()) return false;
 
-#if 0
-  auto am_i_the_closest_to_npc = [this]() {
-    const auto npc_pos = ped->GetPosition();
-    const auto my_player_id = utils::samp_get_my_id();
-    const auto my_distance_to_npc = DistanceBetweenPoints(npc_pos, FindPlayerPed()->GetPosition());
-    for (auto i = 0; i < 1000; ++i) {
-      if (i == my_player_id) continue;
-      if (auto other_player_ped = utils::get_samp_player_ped_game_ptr(i);
-          other_player_ped != nullptr && !utils::samp_is_player_afk(i) && DistanceBetweenPoints(other_player_ped->GetPosition(), npc_pos) < my_distance_to_npc) {
-        return false;
-      }
-    }
-    return true;
-  };
-#endif
-
   const auto now = std::chrono::steady_clock::now();
 
   auto sent_sync = false;
 
   if (now - last_sync_send_check > get_sync_send_rate()) {
-#if 0
-    const auto should_send_this_frame = !sent_sync_once || am_i_the_closest_to_npc();
-#else
-    const auto should_send_this_frame = true;
-#endif
+    // The first sync tells the server we support npcs, then only the owner uploads
+    const auto should_send_this_frame = !sent_sync_once || sync_owner;
     if (should_send_this_frame) {
       send_sync();
       sent_sync = true;
@@ -441,6 +460,77 @@ void npcs_module::npc::wander() {
   set_current_task(task);
 }
 
+void npcs_module::npc::run_sequence(task_sequence_t &&task_sequence) {
+  sequence = std::move(task_sequence);
+  sequence_running = !sequence.steps.empty() && sequence.step < sequence.steps.size();
+  if (sequence_running) {
+    start_sequence_step();
+  } else {
+    stand_still();
+  }
+}
+
+void npcs_module::npc::stop_sequence() {
+  sequence_running = false;
+  sequence = task_sequence_t();
+}
+
+void npcs_module::npc::start_sequence_step() {
+  auto &step = sequence.steps[sequence.step];
+  sequence_step_started = std::chrono::steady_clock::now();
+
+  if (!step.empty() && step[0] == 2) { // go to point: task id, then the destination
+    BitStream target_bs(step.data(), static_cast<unsigned int>(step.size()), false);
+    target_bs.IgnoreBits(8);
+    target_bs.Read(sequence_step_target.x);
+    target_bs.Read(sequence_step_target.y);
+    target_bs.Read(sequence_step_target.z);
+  }
+
+  BitStream bs(step.data(), static_cast<unsigned int>(step.size()), false);
+  apply_task(bs, *this);
+}
+
+bool npcs_module::npc::is_sequence_step_done() const {
+  // Game tasks take a few frames to start
+  if (std::chrono::steady_clock::now() - sequence_step_started < std::chrono::milliseconds(250)) {
+    return false;
+  }
+
+  const auto task_id = sequence.steps[sequence.step].empty() ? 0 : sequence.steps[sequence.step][0];
+  switch (task_id) {
+    case 0: // stand still, nothing to wait for
+      return true;
+    case 2: // go to point, the game task keeps standing still at the destination
+      return DistanceBetweenPoints(CVector2D(ped->GetPosition()), CVector2D(sequence_step_target)) <= 1.5f
+        || get_active_task() == nullptr;
+    default: // animation has ended, attack or follow target is gone
+      return get_active_task() == nullptr;
+  }
+}
+
+void npcs_module::npc::update_sequence() {
+  if (!sequence_running || !is_ped_valid() || is_dead() || !is_sequence_step_done()) {
+    return;
+  }
+
+  // Everyone runs the steps, only the owner tells the server about it
+  if (sync_owner) {
+    report_sequence_step(my_id, sequence.step);
+  }
+
+  if (++sequence.step >= sequence.steps.size()) {
+    sequence.step = 0;
+    ++sequence.pass;
+    if (!sequence.loop && sequence.pass >= sequence.repeat) {
+      stop_sequence();
+      stand_still();
+      return;
+    }
+  }
+  start_sequence_step();
+}
+
 void npcs_module::npc::go_to_point(const CVector &point, npc_move_mode_t mode) {
   if (!is_ped_valid() || is_dead())
     return;
@@ -499,6 +589,10 @@ bool npcs_module::npc::is_stun_enabled() const {
   return stun_enabled;
 }
 
+bool npcs_module::npc::is_sync_owner() const {
+  return sync_owner;
+}
+
 bool npcs_module::npc::is_aggressive_attack() const {
   return aggressive_attack;
 }
@@ -527,11 +621,12 @@ std::chrono::milliseconds npcs_module::npc::get_sync_send_rate() const {
   if (dist <= 0.02f) {
     default_sendrate = ms(600);
   } else if (dist <= 0.07f) {
-    default_sendrate *= 5;
+    default_sendrate *= 6;
   } else if (dist <= 0.12f) {
-    default_sendrate *= 4;
+    default_sendrate *= 5;
   } else {
-    default_sendrate *= 3;
+    // Server extrapolates along the sent velocity, straight moves need fewer syncs
+    default_sendrate *= 4;
   }
 
   return default_sendrate + ms(npcs.size());
@@ -573,6 +668,11 @@ void npcs_module::npc::send_sync() {
     data.pos_z = my_pos.z;
 
     data.heading = my_heading;
+
+    // Game move speed is in units per frame at 50 fps
+    data.vel_x = ped->m_vecMoveSpeed.x * 50.f;
+    data.vel_y = ped->m_vecMoveSpeed.y * 50.f;
+    data.vel_z = ped->m_vecMoveSpeed.z * 50.f;
   }
 
   send_npc_sync_packet(my_id, data);
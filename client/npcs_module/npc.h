@@ -12,6 +12,7 @@ class npc {
   std::chrono::steady_clock::time_point last_sync_send_check;
   CVector last_send_sync_pos;
   bool sent_sync_once = false;
+  bool sync_owner = false; // given by the server, only the owner uploads sync
 
   uint16_t my_id = 0; // 0 is an invalid npc id
   uint16_t player_attack_to = kInvalidTargetId;
@@ -27,6 +28,21 @@ public:
     kSprint
   };
 
+  // Steps are kept as sent by the server, each one is a task id followed by its data
+  struct task_sequence_t {
+    std::vector<std::vector<uint8_t>> steps;
+    bool loop = false;
+    uint16_t repeat = 1;
+    uint8_t step = 0;
+    uint16_t pass = 0;
+  };
+private:
+  task_sequence_t sequence;
+  bool sequence_running = false;
+  std::chrono::steady_clock::time_point sequence_step_started;
+  CVector sequence_step_target; // destination of a go to point step
+public:
+
   npc(uint16_t id, uint16_t model_id, const CVector &position);
   ~npc();
 
@@ -36,7 +52,9 @@ public:
   npc &operator=(const npc &) = delete;
   npc &operator=(npc &&) = default;
 
+  void set_skin(uint16_t model_id);
   void set_stun_enabled(bool enabled);
+  void set_sync_owner(bool owner);
   void set_position(const CVector &position);
   void set_heading(float heading);
   void set_weapon_accuracy(uint8_t accuracy);
@@ -44,6 +62,7 @@ public:
   void set_weapon_skill(uint8_t skill);
   void set_current_weapon(uint8_t weapon_id, uint32_t ammo, uint16_t ammo_in_clip = 0xFFFF);
   void set_health(float health);
+  void revive(float health);
   void put_in_vehicle(CVehicle *vehicle, int seat);
   void remove_from_vehicle();
   void enter_vehicle(CVehicle *vehicle, int seat, std::chrono::milliseconds timeout = std::chrono::milliseconds(5000));
@@ -59,6 +78,8 @@ public:
   void follow_player(uint16_t samp_player_id);
   void stand_still();
   void wander();
+  void run_sequence(task_sequence_t &&task_sequence);
+  void stop_sequence();
   void go_to_point(const CVector &point, npc_move_mode_t mode = npc_move_mode_t::kRun);
   void run_named_animation(const std::string &anim_library,
                            const std::string &anim_name,
@@ -70,6 +91,7 @@ public:
                            std::chrono::milliseconds time = std::chrono::milliseconds(0));
 
   bool is_stun_enabled() const;
+  bool is_sync_owner() const;
   bool is_aggressive_attack() const;
   CPed *get_ped() const;
   CVehicle *get_vehicle() const;
@@ -80,6 +102,11 @@ private:
 
   void send_sync();
 
+  // Task sequence helpers
+  void start_sequence_step();
+  bool is_sequence_step_done() const;
+  void update_sequence();
+
   // Follow task helpers
   bool is_following_target() const;
   bool should_follow_target() const;
@@ -1,12 +1,17 @@
 #include "npcs_module.h"
 #include "utils.h"
 
+#include <NpcSyncQuantization.hpp>
+
 void npcs_module::initialize() {
   register_rpc();
 }
 
 void npcs_module::reset() {
   npcs.clear();
+  npcs_sync_data.clear();
+  use_quantized_sync = false;
+  last_reported_load = 0; // server forgets it along with the player
 }
 
 void npcs_module::destroy() {
@@ -31,6 +36,10 @@ void npcs_module::loop() {
       npc.second.send_sync_if_required();
     }
   }
+
+  if (should_send_sync && !npcs.empty()) {
+    report_load_if_required();
+  }
 }
 
 void npcs_module::register_rpc() {
@@ -50,188 +59,328 @@ void npcs_module::unregister_rpc() {
 void npcs_module::process_rpc(RPCParameters *params) {
   BitStream bs(params->input, BITS_TO_BYTES(params->numberOfBitsOfData), false);
 
-  auto read_str_u8 = [](BitStream &bs, std::string &out) -> bool
-  {
-    uint8_t len = 0;
-    if (!bs.Read(len)) return false;
-    out.resize(len + 1, '\0');
-    auto res = bs.Read(out.data(), len);
-    out.resize(out.find('\0'));
-    return res;
-  };
-
   uint8_t rpc_type_ = 0;
   bs.Read(rpc_type_);
 
-  auto setup_npc_active_task = false;
   auto rpc_type = static_cast<control_rpc_id_t>(rpc_type_);
+  if (rpc_type == control_rpc_id_t::kStreamBatch) {
+    process_stream_batch(bs);
+    return;
+  }
 
   uint16_t npc_id = 0xFFFF;
   bs.Read(npc_id);
 
-  auto npc_iter = npcs.find(npc_id);
   if (rpc_type == control_rpc_id_t::kStreamIn) {
+    process_stream_in(bs, npc_id);
+  } else if (rpc_type == control_rpc_id_t::kStreamOut) {
+    npcs.erase(npc_id);
+    npcs_sync_data.erase(npc_id);
+  } else if (rpc_type == control_rpc_id_t::kSetActiveTask) {
+    if (auto npc_iter = npcs.find(npc_id); npc_iter != npcs.end()) {
+      process_active_task(bs, npc_iter->second);
+    }
+  } else if (rpc_type == control_rpc_id_t::kSetSyncOwner) {
+    uint8_t owner = 0;
+    if (auto npc_iter = npcs.find(npc_id); npc_iter != npcs.end() && bs.Read(owner)) {
+      npc_iter->second.set_sync_owner(owner != 0);
+    }
+  } else if (rpc_type == control_rpc_id_t::kUpdateState) {
+    process_state_update(bs, npc_id);
+  } else if (rpc_type == control_rpc_id_t::kRevive) {
+    float health = 100.f;
+    if (auto npc_iter = npcs.find(npc_id); npc_iter != npcs.end() && bs.Read(health)) {
+      npc_iter->second.revive(health);
+      if (auto sync_iter = npcs_sync_data.find(npc_id); sync_iter != npcs_sync_data.end()) {
+        sync_iter->second.health = health;
+      }
+      process_active_task(bs, npc_iter->second);
+    }
+  } else {
+    process_property_update(bs, rpc_type, npc_id);
+  }
+}
+
+void npcs_module::process_state_update(BitStream &bs, uint16_t npc_id) {
+  uint8_t fields = 0;
+  if (!bs.Read(fields)) return;
+
+  for (auto i = 0; i < kStateFieldPropertyCount; ++i) {
+    if (fields & (1 << i)) {
+      const auto rpc_type = static_cast<control_rpc_id_t>(static_cast<int>(control_rpc_id_t::kSetSkin) + i);
+      if (!process_property_update(bs, rpc_type, npc_id)) return;
+    }
+  }
+  if (fields & kStateFieldTask) {
+    if (auto npc_iter = npcs.find(npc_id); npc_iter != npcs.end()) {
+      process_active_task(bs, npc_iter->second);
+    }
+  }
+}
+
+bool npcs_module::process_property_update(BitStream &bs, control_rpc_id_t rpc_type, uint16_t npc_id) {
+  auto npc_iter = npcs.find(npc_id);
+  if (npc_iter == npcs.end()) return false; // stream in is on its way and has got the new value
+  auto &npc = npc_iter->second;
+
+  if (rpc_type == control_rpc_id_t::kSetSkin) {
     uint16_t skin_id = 0;
-    bs.Read(skin_id);
+    if (!bs.Read(skin_id)) return false;
+    npc.set_skin(skin_id);
+  } else if (rpc_type == control_rpc_id_t::kSetHeading) {
+    float heading = 0.f;
+    if (!bs.Read(heading)) return false;
+    npc.set_heading(heading);
+    // Otherwise the next sync interpolation turns it back
+    if (auto sync_iter = npcs_sync_data.find(npc_id); sync_iter != npcs_sync_data.end()) {
+      sync_iter->second.heading = heading;
+    }
+  } else {
+    uint8_t value = 0;
+    if (!bs.Read(value)) return false;
+
+    switch (rpc_type) {
+      case control_rpc_id_t::kSetWeapon:
+        // 0 only clears the weapons
+        npc.set_current_weapon(value, value != 0 ? 2147483640 : 0);
+        break;
+      case control_rpc_id_t::kSetWeaponAccuracy:
+        npc.set_weapon_accuracy(value);
+        break;
+      case control_rpc_id_t::kSetWeaponShootingRate:
+        npc.set_weapon_shooting_rate(value);
+        break;
+      case control_rpc_id_t::kSetWeaponSkill:
+        npc.set_weapon_skill(value);
+        break;
+      case control_rpc_id_t::kSetStunAnimation:
+        npc.set_stun_enabled(value != 0);
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
 
-    CVector pos;
+void npcs_module::process_stream_batch(BitStream &bs) {
+  // Stream outs go first, so restreamed npcs are recreated
+  uint16_t stream_out_count = 0;
+  if (!bs.Read(stream_out_count)) return;
 
-    bs.Read(pos.x);
-    bs.Read(pos.y);
-    bs.Read(pos.z);
+  for (auto i = 0; i < stream_out_count; ++i) {
+    uint16_t npc_id = 0xFFFF;
+    if (!bs.Read(npc_id)) return;
 
-    npc_iter = npcs.insert({npc_id, npc_t(npc_id, skin_id, pos)}).first;
+    npcs.erase(npc_id);
+    npcs_sync_data.erase(npc_id);
+  }
 
-    auto &npc = npc_iter->second;
+  uint16_t stream_in_count = 0;
+  if (!bs.Read(stream_in_count)) return;
 
-    { // Setting up a heading
-      float heading = 0.f;
-      bs.Read(heading);
+  for (auto i = 0; i < stream_in_count; ++i) {
+    uint16_t npc_id = 0xFFFF;
+    if (!bs.Read(npc_id)) return;
 
-      npc.set_heading(heading);
-    }
+    process_stream_in(bs, npc_id);
+  }
+}
 
-    { // Setting up a health
-      float health = 100.f;
-      bs.Read(health);
+void npcs_module::process_stream_in(BitStream &bs, uint16_t npc_id) {
+  uint16_t skin_id = 0;
+  bs.Read(skin_id);
 
-      npc.set_health(health);
-    }
+  CVector pos;
 
-    { // Setting up a stun animation
-      uint8_t is_stun_enabled_ = 0;
-      bs.Read(is_stun_enabled_);
-      auto is_stun_enabled = is_stun_enabled_ != 0;
+  bs.Read(pos.x);
+  bs.Read(pos.y);
+  bs.Read(pos.z);
 
-      npc.set_stun_enabled(is_stun_enabled);
-    }
+  auto &npc = npcs.insert({npc_id, npc_t(npc_id, skin_id, pos)}).first->second;
+  auto &sync_data = npcs_sync_data[npc_id];
+  sync_data = npc_sync_receive_data_t();
+  sync_data.pos_x = pos.x;
+  sync_data.pos_y = pos.y;
+  sync_data.pos_z = pos.z;
 
-    { // Setting up a weapon
-      uint8_t weapon_id = 0;
+  { // Setting up a heading
+    float heading = 0.f;
+    bs.Read(heading);
 
-      bs.Read(weapon_id);
-      if (weapon_id != 0) {
-        npc.set_current_weapon(weapon_id, 2147483640);
-      }
-    }
+    npc.set_heading(heading);
+    sync_data.heading = heading;
+  }
 
-    { // Setting up a weapon accuracy, shooting rate and skill
-      uint8_t accuracy = 0;
-      uint8_t shooting_rate = 0;
-      uint8_t skill = 0;
+  { // Setting up a health
+    float health = 100.f;
+    bs.Read(health);
 
-      bs.Read(accuracy);
-      bs.Read(shooting_rate);
-      bs.Read(skill);
+    npc.set_health(health);
+    sync_data.health = health;
+  }
 
-      npc.set_weapon_accuracy(accuracy);
-      npc.set_weapon_shooting_rate(shooting_rate);
-      npc.set_weapon_skill(skill);
-    }
+  { // Setting up a stun animation
+    uint8_t is_stun_enabled_ = 0;
+    bs.Read(is_stun_enabled_);
+    auto is_stun_enabled = is_stun_enabled_ != 0;
 
-    // After all data above task data is sent
-    setup_npc_active_task = true;
-  } else if (rpc_type == control_rpc_id_t::kStreamOut) {
-    if (npc_iter != npcs.end()) {
-      npcs.erase(npc_iter);
+    npc.set_stun_enabled(is_stun_enabled);
+  }
+
+  { // Setting up a weapon
+    uint8_t weapon_id = 0;
+
+    bs.Read(weapon_id);
+    if (weapon_id != 0) {
+      npc.set_current_weapon(weapon_id, 2147483640);
     }
-  } else if (rpc_type == control_rpc_id_t::kSetActiveTask) {
-    setup_npc_active_task = true;
   }
 
-  if (setup_npc_active_task && npc_iter != npcs.end()) {
-    // Setting up task
-    // setup_npc_active_task is true if kSetActiveTask or kStreamIn sent
+  { // Setting up a weapon accuracy, shooting rate and skill
+    uint8_t accuracy = 0;
+    uint8_t shooting_rate = 0;
+    uint8_t skill = 0;
 
-    auto &npc = npc_iter->second;
-    uint8_t task_id = 0;
+    bs.Read(accuracy);
+    bs.Read(shooting_rate);
+    bs.Read(skill);
 
-    bs.Read(task_id);
+    npc.set_weapon_accuracy(accuracy);
+    npc.set_weapon_shooting_rate(shooting_rate);
+    npc.set_weapon_skill(skill);
+  }
 
-    switch (task_id) {
-    case 1: { // attack player
-      uint16_t target_player_id = 0xFFFF;
-      uint8_t is_aggressive_ = 0;
+  // After all data above task data is sent
+  process_active_task(bs, npc);
+}
 
-      bs.Read(target_player_id);
-      bs.Read(is_aggressive_);
+void npcs_module::process_active_task(BitStream &bs, npc_t &npc) {
+  npc.stop_sequence();
+  apply_task(bs, npc);
+}
 
-      auto is_aggressive = is_aggressive_ != 0;
+void npcs_module::apply_task(BitStream &bs, npc_t &npc) {
+  auto read_str_u8 = [](BitStream &bs, std::string &out) -> bool
+  {
+    uint8_t len = 0;
+    if (!bs.Read(len)) return false;
+    out.resize(len + 1, '\0');
+    auto res = bs.Read(out.data(), len);
+    out.resize(out.find('\0'));
+    return res;
+  };
 
-      npc.attack_player(target_player_id, is_aggressive);
-      break;
-    }
-    case 2: { // go to point
-      CVector target;
+  uint8_t task_id = 0;
 
-      uint8_t mode;
+  bs.Read(task_id);
 
-      bs.Read(target.x);
-      bs.Read(target.y);
-      bs.Read(target.z);
+  switch (task_id) {
+  case 1: { // attack player
+    uint16_t target_player_id = 0xFFFF;
+    uint8_t is_aggressive_ = 0;
 
-      bs.Read(mode);
+    bs.Read(target_player_id);
+    bs.Read(is_aggressive_);
 
-      npc.go_to_point(target, static_cast<npc::npc_move_mode_t>(mode));
-      break;
-    }
-    case 3: { // follow player
-      uint16_t target_player_id = 0xFFFF;
-      bs.Read(target_player_id);
+    auto is_aggressive = is_aggressive_ != 0;
 
-      npc.follow_player(target_player_id);
-      break;
-    }
-    case 4: { // run named anim
-      std::string anim_lib;
-      std::string anim_name;
-      float delta;
-      uint8_t loop_;
-      uint8_t lock_x_;
-      uint8_t lock_y_;
-      uint8_t freeze_;
-      uint32_t time;
-
-      read_str_u8(bs, anim_lib);
-      read_str_u8(bs, anim_name);
-      bs.Read(delta);
-      bs.Read(loop_);
-      bs.Read(lock_x_);
-      bs.Read(lock_y_);
-      bs.Read(freeze_);
-      bs.Read(time);
-
-      bool loop = loop_ != 0;
-      bool lock_x = lock_x_ != 0;
-      bool lock_y = lock_y_ != 0;
-      bool freeze = freeze_ != 0;
-
-      npc.run_named_animation(anim_lib, anim_name, delta, loop, lock_x, lock_y, freeze, std::chrono::milliseconds(time));
-      break;
-    }
-    case 5: { // attack npc
-      uint16_t target_npc_id = 0xFFFF;
-      uint8_t is_aggressive_ = 0;
+    npc.attack_player(target_player_id, is_aggressive);
+    break;
+  }
+  case 2: { // go to point
+    CVector target;
 
-      bs.Read(target_npc_id);
-      bs.Read(is_aggressive_);
+    uint8_t mode;
 
-      auto is_aggressive = is_aggressive_ != 0;
+    bs.Read(target.x);
+    bs.Read(target.y);
+    bs.Read(target.z);
 
-      npc.attack_npc(target_npc_id, is_aggressive);
-      break;
-    }
-    default: {
-      // Considered as stand still task (0 id)
-      npc.stand_still();
-      break;
-    }
+    bs.Read(mode);
+
+    npc.go_to_point(target, static_cast<npc::npc_move_mode_t>(mode));
+    break;
+  }
+  case 3: { // follow player
+    uint16_t target_player_id = 0xFFFF;
+    bs.Read(target_player_id);
+
+    npc.follow_player(target_player_id);
+    break;
+  }
+  case 4: { // run named anim
+    std::string anim_lib;
+    std::string anim_name;
+    float delta;
+    uint8_t loop_;
+    uint8_t lock_x_;
+    uint8_t lock_y_;
+    uint8_t freeze_;
+    uint32_t time;
+
+    read_str_u8(bs, anim_lib);
+    read_str_u8(bs, anim_name);
+    bs.Read(delta);
+    bs.Read(loop_);
+    bs.Read(lock_x_);
+    bs.Read(lock_y_);
+    bs.Read(freeze_);
+    bs.Read(time);
+
+    bool loop = loop_ != 0;
+    bool lock_x = lock_x_ != 0;
+    bool lock_y = lock_y_ != 0;
+    bool freeze = freeze_ != 0;
+
+    npc.run_named_animation(anim_lib, anim_name, delta, loop, lock_x, lock_y, freeze, std::chrono::milliseconds(time));
+    break;
+  }
+  case 5: { // attack npc
+    uint16_t target_npc_id = 0xFFFF;
+    uint8_t is_aggressive_ = 0;
+
+    bs.Read(target_npc_id);
+    bs.Read(is_aggressive_);
+
+    auto is_aggressive = is_aggressive_ != 0;
+
+    npc.attack_npc(target_npc_id, is_aggressive);
+    break;
+  }
+  case kTaskIdSequence: {
+    npc::task_sequence_t sequence;
+
+    uint8_t step_count = 0;
+    bs.Read(step_count);
+    for (auto i = 0; i < step_count; ++i) {
+      uint16_t step_size = 0;
+      if (!bs.Read(step_size)) return;
+
+      auto &step = sequence.steps.emplace_back(step_size);
+      if (!bs.Read(reinterpret_cast<char*>(step.data()), step_size)) return;
     }
+
+    uint8_t loop_ = 0;
+    bs.Read(loop_);
+    bs.Read(sequence.repeat);
+    bs.Read(sequence.step);
+    bs.Read(sequence.pass);
+    sequence.loop = loop_ != 0;
+
+    npc.run_sequence(std::move(sequence));
+    break;
+  }
+  default: {
+    // Considered as stand still task (0 id)
+    npc.stand_still();
+    break;
+  }
   }
 }
 
 void npcs_module::handle_incoming_packet(uint8_t id, Packet *packet) {
-  if (id != kNpcSyncPacketId) {
+  if (id != kNpcSyncPacketId && id != kNpcSyncBatchPacketId) {
     return;
   }
 
@@ -243,24 +392,66 @@ void npcs_module::handle_incoming_packet(uint8_t id, Packet *packet) {
   BitStream bs(packet->data, BITS_TO_BYTES(packet->bitSize), false);
   bs.IgnoreBits(8);
 
+  if (id == kNpcSyncPacketId) {
+    process_sync_entry(bs);
+    return;
+  }
+
+  uint8_t count = 0;
+  bs.Read(count);
+  for (auto i = 0; i < count; ++i) {
+    if (!process_sync_entry(bs)) {
+      return;
+    }
+  }
+}
+
+bool npcs_module::process_sync_entry(BitStream &bs) {
   uint16_t npc_id = 0xFFFF;
-  bs.Read(npc_id);
+  if (!bs.Read(npc_id)) {
+    return false;
+  }
 
-  npc_sync_receive_data_t data;
-  if (bs.GetNumberOfUnreadBits() < BYTES_TO_BITS(sizeof(data))) {
-    return;
+  uint8_t fields = 0;
+  if (!bs.Read(fields)) {
+    return false;
+  }
+
+  use_quantized_sync = (fields & kSyncFieldQuantized) != 0;
+
+  // Fields which are not sent did not change since the last sync
+  // Entries of unknown npcs are still read through to reach the next entry
+  auto sync_data_iter = npcs_sync_data.find(npc_id);
+  auto data = sync_data_iter != npcs_sync_data.end() ? sync_data_iter->second : npc_sync_receive_data_t();
+  if (fields & kSyncFieldPosition) {
+    if (use_quantized_sync) {
+      if (!read_quantized_position(bs, data.pos_x, data.pos_y, data.pos_z)) return false;
+    } else if (!bs.Read(data.pos_x) || !bs.Read(data.pos_y) || !bs.Read(data.pos_z)) {
+      return false;
+    }
+  }
+  if (fields & kSyncFieldHeading) {
+    if (use_quantized_sync) {
+      if (!read_quantized_heading(bs, data.heading)) return false;
+    } else if (!bs.Read(data.heading)) {
+      return false;
+    }
+  }
+  if (fields & kSyncFieldHealth) {
+    if (!bs.Read(data.health)) return false;
+  }
+  if (fields & kSyncFieldVehicle) {
+    if (!bs.Read(data.vehicle) || !bs.Read(data.vehicle_seat)) return false;
   }
 
   auto npc_iter = npcs.find(npc_id);
   if (npc_iter == npcs.end()) {
-    return;
+    return true;
   }
 
-  auto &npc = npc_iter->second;
-
-  bs.Read(data);
-
-  npc.update_from_sync(data);
+  npcs_sync_data[npc_id] = data;
+  npc_iter->second.update_from_sync(data);
+  return true;
 }
 
 void npcs_module::send_control_rpc(const BitStream &bs) {
@@ -275,6 +466,35 @@ void npcs_module::send_control_rpc(const BitStream &bs) {
   rakclient->RPC(&rpc_id, &send_bs, HIGH_PRIORITY, RELIABLE_ORDERED, 0, false);
 }
 
+void npcs_module::report_load_if_required() {
+  const auto now = steady_clock_t::now();
+  if (now - last_load_report < kLoadReportInterval) {
+    return;
+  }
+  last_load_report = now;
+
+  // 60 fps and more = idle, 20 fps and less = fully loaded
+  const auto fps = CTimer::game_FPS;
+  const auto load = static_cast<uint8_t>(std::clamp((60.f - fps) / 40.f * 100.f, 0.f, 100.f));
+  if (std::abs(load - last_reported_load) < 5) {
+    return;
+  }
+  last_reported_load = load;
+
+  BitStream bs;
+  bs.Write(static_cast<uint8_t>(control_rpc_id_t::kReportLoad));
+  bs.Write<uint8_t>(load);
+  send_control_rpc(bs);
+}
+
+void npcs_module::report_sequence_step(uint16_t npc_id, uint8_t step) {
+  BitStream bs;
+  bs.Write(static_cast<uint8_t>(control_rpc_id_t::kSequenceStep));
+  bs.Write<uint16_t>(npc_id);
+  bs.Write<uint8_t>(step);
+  send_control_rpc(bs);
+}
+
 void npcs_module::send_npc_sync_packet(uint16_t npc_id, const npc_sync_send_data_t &data) {
   auto rakclient = utils::get_samp_rakclient_intf();
   if (rakclient == nullptr) return;
@@ -284,11 +504,56 @@ void npcs_module::send_npc_sync_packet(uint16_t npc_id, const npc_sync_send_data
   BitStream send_bs;
   send_bs.Write<uint8_t>(kNpcSyncPacketId);
   send_bs.Write<uint16_t>(npc_id);
-  send_bs.Write(reinterpret_cast<const char*>(&data), sizeof(data)); // avoid copying data
+  if (use_quantized_sync) {
+    send_bs.Write<uint8_t>(kSyncFieldQuantized | kSyncFieldVelocity);
+    write_quantized_position(send_bs, data.pos_x, data.pos_y, data.pos_z);
+    write_quantized_heading(send_bs, data.heading);
+    write_quantized_velocity(send_bs, data.vel_x, data.vel_y, data.vel_z);
+  } else {
+    send_bs.Write<uint8_t>(kSyncFieldVelocity);
+    send_bs.Write(reinterpret_cast<const char*>(&data), sizeof(data)); // avoid copying data
+  }
 
   rakclient->Send(&send_bs, HIGH_PRIORITY, UNRELIABLE_SEQUENCED, 1);
 }
 
+// Fixed point sync encoding is shared with the server, see NpcSyncQuantization
+void npcs_module::write_quantized_position(BitStream &bs, float x, float y, float z) {
+  for (auto axis : {x, y, z}) {
+    const auto value = NpcSyncQuantization::quantizeAxis(axis);
+    bs.Write<int8_t>(NpcSyncQuantization::axisCell(value));
+    bs.Write<uint16_t>(NpcSyncQuantization::axisOffset(value));
+  }
+}
+
+bool npcs_module::read_quantized_position(BitStream &bs, float &x, float &y, float &z) {
+  for (auto axis : {&x, &y, &z}) {
+    int8_t cell = 0;
+    uint16_t offset = 0;
+    if (!bs.Read(cell) || !bs.Read(offset)) return false;
+    *axis = NpcSyncQuantization::dequantizeAxis(NpcSyncQuantization::joinAxis(cell, offset));
+  }
+  return true;
+}
+
+void npcs_module::write_quantized_heading(BitStream &bs, float heading) {
+  // 360 degrees wraps to 0
+  bs.Write<uint16_t>(NpcSyncQuantization::quantizeHeading(heading));
+}
+
+bool npcs_module::read_quantized_heading(BitStream &bs, float &heading) {
+  uint16_t value = 0;
+  if (!bs.Read(value)) return false;
+  heading = NpcSyncQuantization::dequantizeHeading(value);
+  return true;
+}
+
+void npcs_module::write_quantized_velocity(BitStream &bs, float x, float y, float z) {
+  for (auto axis : {x, y, z}) {
+    bs.Write<uint16_t>(static_cast<uint16_t>(NpcSyncQuantization::quantizeVelocity(axis)));
+  }
+}
+
 bool npcs_module::handle_damage(CEntity *damager,
                                 CPed *receiver,
                                 float amount,
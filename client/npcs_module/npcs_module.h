@@ -4,6 +4,7 @@
 
 namespace npcs_module {
 constexpr auto kNpcSyncPacketId = NPC_SYNC_PACKET_ID;
+constexpr auto kNpcSyncBatchPacketId = NPC_SYNC_BATCH_PACKET_ID;
 constexpr auto kNpcControlRpcId = NPC_CONTROL_RPC_ID;
 
 enum class control_rpc_id_t {
@@ -14,6 +15,45 @@ enum class control_rpc_id_t {
   kTakeDamage, // by client
 
   kSetActiveTask, // by server
+
+  kStreamBatch, // by server
+
+  kSetSyncOwner, // by server
+  kReportLoad, // by client
+
+  // Single property updates of a streamed npc, applied in place, by server
+  kSetSkin,
+  kSetWeapon,
+  kSetWeaponAccuracy,
+  kSetWeaponShootingRate,
+  kSetWeaponSkill,
+  kSetStunAnimation,
+  kSetHeading,
+
+  kUpdateState, // many of the above and the active task at once, by server
+
+  kRevive, // health and active task of a dead npc, by server
+
+  kSequenceStep, // step of a task sequence is completed, by client
+};
+
+constexpr auto kTaskIdSequence = 6;
+
+// Fields of kUpdateState, property bits follow the control rpc order starting at kSetSkin
+enum state_field_t : uint8_t {
+  kStateFieldPropertyCount = 7,
+  kStateFieldTask = 1 << 7,
+};
+
+// Fields of received sync, only the changed ones are sent
+enum sync_field_t : uint8_t {
+  kSyncFieldPosition = 1 << 0,
+  kSyncFieldHeading = 1 << 1,
+  kSyncFieldHealth = 1 << 2,
+  kSyncFieldVehicle = 1 << 3, // vehicle id and seat
+  kSyncFieldVelocity = 1 << 4, // uploaded only, lets the server extrapolate the position between our syncs
+
+  kSyncFieldQuantized = 1 << 7, // not a field, position and heading are fixed point
 };
 
 using steady_clock_t = std::chrono::steady_clock;
@@ -33,6 +73,11 @@ struct npc_sync_send_data_t {
   float pos_z = 0.f;
 
   float heading = 0.f;
+
+  // m/s
+  float vel_x = 0.f;
+  float vel_y = 0.f;
+  float vel_z = 0.f;
 };
 
 struct npc_sync_receive_data_t {
@@ -49,6 +94,17 @@ struct npc_sync_receive_data_t {
 };
 #pragma pack(pop)
 
+// Last received sync of created npcs, partial syncs are applied on top of it
+inline std::unordered_map<uint16_t, npc_sync_receive_data_t> npcs_sync_data;
+
+// Client load is reported this often, server gives busy clients fewer npcs to simulate
+constexpr auto kLoadReportInterval = std::chrono::seconds(2);
+inline steady_clock_t::time_point last_load_report;
+inline uint8_t last_reported_load = 0;
+
+// Server sends quantized sync, so it's used for our uploads as well
+inline bool use_quantized_sync = false;
+
 // Initialization and destruction itself
 void initialize();
 void reset();
@@ -61,9 +117,24 @@ void loop();
 void register_rpc();
 void unregister_rpc();
 void process_rpc(RPCParameters *params);
+void process_stream_in(BitStream &bs, uint16_t npc_id);
+void process_stream_batch(BitStream &bs);
+void process_active_task(BitStream &bs, npc_t &npc);
+// Runs the task without stopping a task sequence, sequence steps are run this way
+void apply_task(BitStream &bs, npc_t &npc);
 void handle_incoming_packet(uint8_t id, Packet *packet);
+bool process_sync_entry(BitStream &bs);
 void send_control_rpc(const BitStream &bs);
+void report_load_if_required();
+void report_sequence_step(uint16_t npc_id, uint8_t step);
 void send_npc_sync_packet(uint16_t npc_id, const npc_sync_send_data_t &data);
+void write_quantized_position(BitStream &bs, float x, float y, float z);
+bool read_quantized_position(BitStream &bs, float &x, float &y, float &z);
+void write_quantized_heading(BitStream &bs, float heading);
+bool read_quantized_heading(BitStream &bs, float &heading);
+bool process_property_update(BitStream &bs, control_rpc_id_t rpc_type, uint16_t npc_id);
+void process_state_update(BitStream &bs, uint16_t npc_id);
+void write_quantized_velocity(BitStream &bs, float x, float y, float z);
 
 // Game events handlers
 bool handle_damage(CEntity *damager, CPed *receiver, float amount, uint32_t body_part, uint32_t weapon_type);
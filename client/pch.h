@@ -9,6 +9,7 @@
 #include <cstdint>
 #include <chrono>
 #include <unordered_map>
+#include <vector>
 #include <string>
 #include <filesystem>
 #include <memory>
@@ -37,5 +38,6 @@
 #include <CTaskComplexDie.h>
 
 #include <CStreaming.h>
+#include <CTimer.h>
 #include <CWorld.h>
 #include <CModelInfo.h>
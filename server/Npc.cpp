@@ -2,6 +2,69 @@
 #include "NpcComponent.h"
 #include "NpcNetwork.hpp"
 
+namespace {
+/// Npc keeps moving along the synced velocity for that long without new syncs
+constexpr Milliseconds kMaxExtrapolation = Milliseconds(1000);
+/// m/s, vertical velocity is not limited by the move mode
+constexpr float kMaxFallSpeed = 50.f;
+/// Clients consider a go to point task done that close to the destination, meters
+constexpr float kArrivalRadius = 1.5f;
+
+/// Horizontal speed limit of the task move mode, m/s, works for both NpcTasksSet and NpcSequenceStep
+template <typename Task>
+float maxMoveSpeedOf(const Task &task) {
+  // m/s, a bit above what the game peds reach, slopes and stun pushes included
+  static constexpr float kWalkSpeed = 3.f;
+  static constexpr float kRunSpeed = 7.f;
+  static constexpr float kSprintSpeed = 10.f;
+
+  if (const auto goTo = std::get_if<NpcTaskGoToPoint>(&task); goTo != nullptr) {
+    switch (goTo->mode) {
+      case NpcMoveMode_Walk: return kWalkSpeed;
+      case NpcMoveMode_Run: return kRunSpeed;
+      default: return kSprintSpeed;
+    }
+  }
+  if (std::holds_alternative<NpcTaskFollowPlayer>(task)
+      || std::holds_alternative<NpcTaskAttackPlayer>(task)
+      || std::holds_alternative<NpcTaskAttackNpc>(task)) {
+    return kSprintSpeed;
+  }
+  // Standing or playing an animation, which may move the npc as well
+  return kRunSpeed;
+}
+
+/// Player or npc the task points to, nullptr if there is none
+template <typename Task>
+const void *taskTargetOf(const Task &task) {
+  if (const auto attack = std::get_if<NpcTaskAttackPlayer>(&task); attack != nullptr) {
+    return attack->target;
+  } else if (const auto follow = std::get_if<NpcTaskFollowPlayer>(&task); follow != nullptr) {
+    return follow->target;
+  } else if (const auto attack = std::get_if<NpcTaskAttackNpc>(&task); attack != nullptr) {
+    return attack->target;
+  }
+  return nullptr;
+}
+
+/// Writes the payload again only if the npc state has changed since the last time
+template <typename Fn>
+const NpcEncodedPayload &encodeOnce(NpcEncodedPayload &payload, uint32_t version, Fn &&write) {
+  if (payload.version == version) {
+    NpcComponent::instance().recordEncode(true, 0);
+    return payload;
+  }
+
+  NetworkBitStream bs;
+  write(bs);
+  payload.version = version;
+  payload.bits = bs.GetNumberOfBitsUsed();
+  payload.data.assign(bs.GetData(), bs.GetData() + bs.GetNumberOfBytesUsed());
+  NpcComponent::instance().recordEncode(false, payload.data.size());
+  return payload;
+}
+}
+
 Npc::Npc(int skin, Vector3 position, bool* allAnimationLibraries, bool* validateAnimations)
     : skin(skin),
       pos(position),
@@ -13,21 +76,13 @@ Npc::Npc(int skin, Vector3 position, bool* allAnimationLibraries, bool* validate
       weaponShootingRate(70),
       invulnerable(false),
       stunAnimationEnabled(true),
-      shouldBroadcastSyncPacket(false),
       weaponSkill(NpcWeaponSkillType_STD),
       currentTask(NpcTaskStandStill()),
       currentVehicle(nullptr),
 
       allAnimationLibraries_(allAnimationLibraries),
       validateAnimations_(validateAnimations) {
-  /* Nothing to do */
-}
-
-void Npc::restream() {
-  for (auto player : streamedFor_.entries()) {
-    streamOutForClient(*player);
-    streamInForClient(*player);
-  }
+  movementValidator.reset(position, Time::now());
 }
 
 void Npc::destream() {
@@ -37,39 +92,30 @@ void Npc::destream() {
 }
 
 void Npc::streamInForClient(IPlayer &player) {
-  NpcControlRpc rpc;
-  rpc.Type = NpcControlRpc::NpcControlRpcType_StreamIn;
-  rpc.NpcID = getID();
-  rpc.StreamIn.Skin = skin;
-  rpc.StreamIn.Position = pos;
-  rpc.StreamIn.Heading = angle;
-  rpc.StreamIn.Health = health;
-  rpc.StreamIn.StunEnabled = stunAnimationEnabled;
-  rpc.StreamIn.WeaponID = currentWeaponId;
-  rpc.StreamIn.WeaponShootingAccuracy = weaponShootingAccuracy;
-  rpc.StreamIn.WeaponShootingRate = weaponShootingRate;
-  rpc.StreamIn.WeaponSkill = weaponSkill;
-  rpc.StreamIn.Task = currentTask;
-  PacketHelper::send(rpc, player);
+  NpcComponent::instance().queueStreamIn(*this, player);
 }
 
 void Npc::streamOutForClient(IPlayer &player) {
-  NpcControlRpc rpc;
-  rpc.Type = NpcControlRpc::NpcControlRpcType_StreamOut;
-  rpc.NpcID = getID();
-  PacketHelper::send(rpc, player);
+  NpcComponent::instance().queueStreamOut(*this, player);
 }
 
-void Npc::broadcastSyncIfRequired(Milliseconds onfootSyncRate) {
-  if (!shouldBroadcastSyncPacket) return;
-  if (const auto now = Time::now(); now - lastSyncBroadcast > onfootSyncRate) {
-    broadcastSync();
-    lastSyncBroadcast = now;
-    shouldBroadcastSyncPacket = false;
+void Npc::requestSync() {
+  NpcComponent::instance().scheduleSync(*this);
+}
+
+void Npc::broadcastSync(bool keyframe) {
+  syncKeyframeQueued |= keyframe;
+  if (!syncQueued) {
+    syncQueued = true;
+    NpcComponent::instance().queueSync(*this);
   }
 }
 
-void Npc::broadcastSync() {
+void Npc::sendSync() {
+  const auto keyframe = syncKeyframeQueued;
+  syncQueued = false;
+  syncKeyframeQueued = false;
+
   NpcSyncPacket data;
 
   data.NpcID = getID();
@@ -79,7 +125,109 @@ void Npc::broadcastSync() {
   data.VehicleId = currentVehicle != nullptr ? currentVehicle->getID() : INVALID_VEHICLE_ID;
   data.VehicleSeatIndex = currentVehicle != nullptr ? currentVehicleSeat : 0;
 
-  PacketHelper::broadcastToSome(data, streamedFor_.entries());
+  const auto now = Time::now();
+  const auto &component = NpcComponent::instance();
+  const auto keyframeInterval = component.getSyncKeyframeInterval();
+  const uint8_t encoding = component.isSyncQuantized() ? NpcSyncField_Quantized : 0;
+  const auto npcPos = getPosition();
+  // Important npcs climb the queue faster, distance slows it down past kPriorityNearDistance
+  static constexpr float kPriorityNearDistance = 10.f;
+  const auto importance = 1.f + static_cast<float>(std::max(0, streamPriority));
+  auto deferred = false;
+  for (auto player : streamedFor_.entries()) {
+    auto &link = syncLinks[player->getID()];
+    const auto forced = keyframe || link.keyframePending;
+    // Far players wait for their turn, forced keyframes (corrections) go to everyone
+    if (!forced && link.hasBaseline && now < link.nextSync) {
+      deferred = true;
+      continue;
+    }
+
+    const auto dist3D = player->getPosition() - npcPos;
+    const auto distSqr = glm::dot(dist3D, dist3D);
+    if (link.lastPriorityUpdate != TimePoint()) {
+      const auto waited = std::chrono::duration<float, std::milli>(now - link.lastPriorityUpdate).count();
+      link.priority += waited * importance * kPriorityNearDistance / std::max(kPriorityNearDistance, std::sqrt(distSqr));
+    }
+    link.lastPriorityUpdate = now;
+
+    // Each player gets only what differs from the last sync they've got
+    if (forced || !link.hasBaseline || now - link.lastKeyframe >= keyframeInterval) {
+      data.Fields = NpcSyncField_All;
+    } else {
+      data.Fields = 0;
+      if (link.pos != data.Position) data.Fields |= NpcSyncField_Position;
+      if (link.heading != data.Heading) data.Fields |= NpcSyncField_Heading;
+      if (link.health != data.Health) data.Fields |= NpcSyncField_Health;
+      if (link.vehicleId != data.VehicleId || link.vehicleSeat != data.VehicleSeatIndex) data.Fields |= NpcSyncField_Vehicle;
+      if (data.Fields == 0) {
+        continue;
+      }
+    }
+    data.Fields |= encoding;
+    data.EncodedEntry = &getSyncPayload(data.Fields);
+
+    // Corrections go first, the link is updated once the sync fits into the player budget
+    const auto priority = forced ? std::numeric_limits<float>::max() : link.priority;
+    NpcComponent::instance().queueSyncPacket(data, *this, *player, priority);
+  }
+
+  // Skipped players get the changes with one of the next syncs
+  if (deferred) {
+    requestSync();
+  }
+}
+
+void Npc::onSyncSent(const IPlayer &player, const NpcSyncPacket &packet, TimePoint now) {
+  const auto it = syncLinks.find(player.getID());
+  if (it == syncLinks.end()) {
+    return;
+  }
+  auto &link = it->second;
+  if ((packet.Fields & NpcSyncField_All) == NpcSyncField_All) {
+    link.lastKeyframe = now;
+    link.keyframePending = false;
+  }
+  link.hasBaseline = true;
+  link.pos = packet.Position;
+  link.heading = packet.Heading;
+  link.health = packet.Health;
+  link.vehicleId = packet.VehicleId;
+  link.vehicleSeat = packet.VehicleSeatIndex;
+  link.priority = 0.f;
+  const auto dist3D = player.getPosition() - getPosition();
+  link.nextSync = now + NpcComponent::instance().getSyncInterval(glm::dot(dist3D, dist3D));
+}
+
+void Npc::sendCorrection(IPlayer &player, TimePoint now) {
+  auto &component = NpcComponent::instance();
+  component.recordSyncRejection(player);
+
+  const auto it = syncLinks.find(player.getID());
+  if (it == syncLinks.end() || now - it->second.lastCorrection < component.getSyncCorrectionInterval()) {
+    return;
+  }
+  it->second.lastCorrection = now;
+
+  NpcSyncPacket data;
+  data.NpcID = getID();
+  data.Position = pos;
+  data.Heading = angle;
+  data.Health = health;
+  data.VehicleId = currentVehicle != nullptr ? currentVehicle->getID() : INVALID_VEHICLE_ID;
+  data.VehicleSeatIndex = currentVehicle != nullptr ? currentVehicleSeat : 0;
+  data.Fields = NpcSyncField_All | (component.isSyncQuantized() ? NpcSyncField_Quantized : 0);
+  data.EncodedEntry = &getSyncPayload(data.Fields);
+  // Goes out with this tick syncs, ahead of anything else in the player budget
+  component.queueSyncPacket(data, *this, player, std::numeric_limits<float>::max());
+  component.recordSyncCorrection(player);
+}
+
+void Npc::onSyncDeferred(const IPlayer &player, const NpcSyncPacket &packet) {
+  if (const auto it = syncLinks.find(player.getID()); it != syncLinks.end() && (packet.Fields & NpcSyncField_All) == NpcSyncField_All) {
+    it->second.keyframePending = true;
+  }
+  requestSync();
 }
 
 bool Npc::isStreamedInForPlayer(const IPlayer &player) const {
@@ -88,18 +236,30 @@ bool Npc::isStreamedInForPlayer(const IPlayer &player) const {
 
 void Npc::streamInForPlayer(IPlayer &player) {
   streamedFor_.add(player.getID(), player);
+  syncLinks[player.getID()] = NpcSyncLink();
+  markSyncAuthorityDirty();
+  NpcComponent::instance().getStreamer().onStreamedIn(*this, player);
   streamInForClient(player);
 }
 
 void Npc::streamOutForPlayer(IPlayer &player) {
   streamedFor_.remove(player.getID(), player);
   verifiedSupportedPlayers_.remove(player.getID(), player);
+  syncLinks.erase(player.getID());
+  if (syncAuthority != nullptr && syncAuthority->getID() == player.getID()) {
+    // Player might be leaving the server, so the owned count is released right away
+    NpcComponent::instance().onSyncAuthorityChanged(syncAuthority, nullptr);
+    syncAuthority = nullptr;
+  }
+  markSyncAuthorityDirty();
+  NpcComponent::instance().getStreamer().onStreamedOut(*this, player);
   streamOutForClient(player);
 }
 
 void Npc::setSkin(int skin_) {
   skin = skin_;
-  restream();
+  markStateChanged();
+  markDirty(NpcStateField_Skin);
 }
 
 int Npc::getSkin() const {
@@ -109,11 +269,12 @@ int Npc::getSkin() const {
 void Npc::setHealth(float health_) {
   auto oldHealth = health;
   health = health_;
+  markStateChanged();
   broadcastSync();
-  if (oldHealth <= 0.f) {
-    // Simply sending a new health to player does not revive npc
-    // So it's simpler to just restream npc
-    restream();
+  if (oldHealth <= 0.f && health > 0.f) {
+    // Simply sending a new health to player does not revive npc, it carries on with the task it had
+    revivePending = true;
+    markDirty(0); // not a property, it's sent ahead of them by flushStateChanges()
   }
 }
 
@@ -132,7 +293,8 @@ bool Npc::isInvulnerable() const {
 void Npc::setStunAnimationEnabled(bool enabled) {
   if (stunAnimationEnabled != enabled) {
     stunAnimationEnabled = enabled;
-    restream();
+    markStateChanged();
+    markDirty(NpcStateField_StunAnimation);
   }
 }
 
@@ -146,22 +308,26 @@ void Npc::setWeapon(uint8_t weaponId) {
   if (weapon.slot() == INVALID_WEAPON_SLOT) return;
   if (weapon.id == PlayerWeapon_Satchel || weapon.id == PlayerWeapon_Bomb) return;
   currentWeaponId = weaponId;
-  restream();
+  markStateChanged();
+  markDirty(NpcStateField_Weapon);
 }
 
 void Npc::setWeaponShootingAccuracy(uint8_t accuracy) {
   weaponShootingAccuracy = std::clamp(accuracy, static_cast<uint8_t>(0), static_cast<uint8_t>(100u));
-  restream();
+  markStateChanged();
+  markDirty(NpcStateField_WeaponAccuracy);
 }
 
 void Npc::setWeaponShootingRate(uint8_t shootingRate) {
   weaponShootingRate = std::clamp(shootingRate, static_cast<uint8_t>(0), static_cast<uint8_t>(100u));
-  restream();
+  markStateChanged();
+  markDirty(NpcStateField_WeaponShootingRate);
 }
 
 void Npc::setWeaponSkill(NpcWeaponSkillType skill) {
   weaponSkill = skill;
-  restream();
+  markStateChanged();
+  markDirty(NpcStateField_WeaponSkill);
 }
 
 void Npc::putInVehicle(IVehicle &vehicle, int seat) {
@@ -171,6 +337,9 @@ void Npc::putInVehicle(IVehicle &vehicle, int seat) {
 
   currentVehicle = &vehicle;
   currentVehicleSeat = seat;
+  resetVelocity();
+  markStateChanged();
+  NpcComponent::instance().getStreamer().update(*this);
 
   broadcastSync();
 }
@@ -185,6 +354,10 @@ void Npc::removeFromVehicle() {
 
   currentVehicle = nullptr;
   currentVehicleSeat = 0;
+  movementValidator.reset(pos, Time::now());
+  resetVelocity();
+  markStateChanged();
+  NpcComponent::instance().getStreamer().update(*this);
 
   broadcastSync();
 }
@@ -207,49 +380,68 @@ void Npc::clearActiveTasks() {
 
 void Npc::standStill() {
   NpcTaskStandStill task;
-  currentTask = task;
-  broadcastActiveTask();
+  setActiveTask(task);
 }
 
 void Npc::goToPoint(const Vector3 &destination, NpcMoveMode mode) {
   NpcTaskGoToPoint task;
   task.destination = destination;
   task.mode = mode;
-  currentTask = task;
-  broadcastActiveTask();
+  setActiveTask(task);
 }
 
 void Npc::attackPlayer(const IPlayer &player, bool aggressive) {
   NpcTaskAttackPlayer task;
   task.target = &player;
   task.aggressive = aggressive;
-  currentTask = task;
-  broadcastActiveTask();
+  setActiveTask(task);
 }
 
 void Npc::attackNpc(const INpc &target, bool aggressive) {
   NpcTaskAttackNpc task;
   task.target = &target;
   task.aggressive = aggressive;
-  currentTask = task;
-  broadcastActiveTask();
+  setActiveTask(task);
 }
 
 void Npc::followPlayer(const IPlayer &player) {
   NpcTaskFollowPlayer task;
   task.target = &player;
-  currentTask = task;
-  broadcastActiveTask();
+  setActiveTask(task);
 }
 
 void Npc::setReliablePlayerForSync(IPlayer *player) {
   manuallyInstalledReliablePlayer = player;
+  markSyncAuthorityDirty();
 }
 
 IPlayer *Npc::getReliablePlayerForSync() const {
   return manuallyInstalledReliablePlayer;
 }
 
+void Npc::setStreamPriority(int priority) {
+  if (streamPriority != priority) {
+    streamPriority = priority;
+    NpcComponent::instance().getStreamer().touch(*this);
+  }
+}
+
+int Npc::getStreamPriority() const {
+  return streamPriority;
+}
+
+void Npc::setStreamRadius(float radius) {
+  radius = std::max(0.f, radius);
+  if (streamRadius != radius) {
+    streamRadius = radius;
+    NpcComponent::instance().getStreamer().updateStreamRadius(*this);
+  }
+}
+
+float Npc::getStreamRadius() const {
+  return streamRadius;
+}
+
 void Npc::playAnimation(const AnimationData &animation) {
   if ((!validateAnimations_ || *validateAnimations_) && !animationLibraryValid(animation.lib, *allAnimationLibraries_))
   {
@@ -257,8 +449,7 @@ void Npc::playAnimation(const AnimationData &animation) {
   }
   NpcTaskPlayAnimation task;
   task.data = animation;
-  currentTask = task;
-  broadcastActiveTask();
+  setActiveTask(task);
 }
 
 int Npc::getID() const {
@@ -269,11 +460,20 @@ Vector3 Npc::getPosition() const {
   if (currentVehicle != nullptr) {
     return currentVehicle->getPosition();
   }
-  return pos;
+  if (velocity == Vector3(0.f)) {
+    return pos;
+  }
+  // Dead reckoning between syncs, the owner may have stopped sending them
+  const auto elapsed = std::min<Milliseconds>(std::chrono::duration_cast<Milliseconds>(Time::now() - lastSyncReceived), kMaxExtrapolation);
+  return pos + velocity * (elapsed.count() / 1000.f);
 }
 
 void Npc::setPosition(Vector3 position) {
   pos = position;
+  movementValidator.reset(pos, Time::now());
+  resetVelocity();
+  markStateChanged();
+  NpcComponent::instance().getStreamer().update(*this);
   broadcastSync();
 }
 
@@ -283,7 +483,8 @@ GTAQuat Npc::getRotation() const {
 
 void Npc::setRotation(GTAQuat rotation) {
   angle = rotation.ToEuler().z;
-  restream();
+  markStateChanged();
+  markDirty(NpcStateField_Heading);
 }
 
 int Npc::getVirtualWorld() const {
@@ -295,85 +496,433 @@ int Npc::getVirtualWorld() const {
 
 void Npc::setVirtualWorld(int vw) {
   virtualWorld = vw;
+  NpcComponent::instance().getStreamer().update(*this);
+}
+
+float Npc::getMaxMoveSpeed() const {
+  if (const auto sequence = std::get_if<NpcTaskSequence>(&currentTask); sequence != nullptr) {
+    // Owner is a step ahead of what it has reported at times, the fastest step is allowed
+    auto speed = 0.f;
+    for (const auto &step : sequence->steps) {
+      speed = std::max(speed, maxMoveSpeedOf(step));
+    }
+    return speed;
+  }
+  return maxMoveSpeedOf(currentTask);
+}
+
+bool Npc::validateMovement(const Vector3 &newPos, TimePoint now) {
+  const auto currentPos = getPosition();
+  const auto dist2D = glm::distance(Vector2(currentPos), Vector2(newPos));
+
+  auto valid = true;
+  if (currentPos.z < -60.f && newPos.z < -70.f && dist2D <= 3.f) {
+    // if we felt under the map
+    // currentPos.z < -60.f -- if we're already below the ground for server
+    // newPos.z < -70.f -- if client is still sending some position below the ground
+    // two checkups were done to avoid immediate teleport below the ground
+  } else if (currentPos.z < -60.f && newPos.z > -20.f) {
+    // 1. current position for server: we're under the map
+    // 2. new position sent by client: we're on the map as should be
+    // teleport too far away is something illegal
+    valid = dist2D <= 80.f;
+    if (valid) {
+      movementValidator.reset(newPos, now); // placed on the ground by the game, not a movement
+      resetVelocity();
+    }
+  } else {
+    valid = movementValidator.validate(newPos, now, getMaxMoveSpeed());
+  }
+
+  NpcComponent::instance().recordMovementValidation(valid, Time::now() - now);
+  return valid;
+}
+
+bool Npc::isExtrapolating() const {
+  // One more streamer update after kMaxExtrapolation, so the grid gets the final position
+  return velocity != Vector3(0.f) && currentVehicle == nullptr && Time::now() - lastSyncReceived < kMaxExtrapolation + Milliseconds(100);
+}
+
+void Npc::resetVelocity() {
+  velocity = Vector3(0.f);
 }
 
 bool Npc::updateFromSync(const NpcSyncPacket &syncPacket, IPlayer *sender) {
-  if (sender != nullptr) {
+  if (sender != nullptr && !verifiedSupportedPlayers_.valid(sender->getID())) {
     verifiedSupportedPlayers_.add(sender->getID(), *sender);
+    markSyncAuthorityDirty();
   }
   const auto newPos = currentVehicle != nullptr ? currentVehicle->getPosition() : syncPacket.Position;
 
-  const auto dist3D = newPos - getPosition();
-  const auto dist = glm::dot(dist3D, dist3D);
+  // Allow sync packet only from the sync owner
+  if (sender != nullptr && !isPlayerReliableForSync(*sender)) {
+    return false;
+  }
+
+  const auto now = Time::now();
+  if (currentVehicle == nullptr && !validateMovement(newPos, now)) {
+    // Only the sender is out of sync, everybody else has got the actual data
+    if (sender != nullptr) {
+      sendCorrection(*sender, now);
+    } else {
+      broadcastSync(true);
+    }
+    return false;
+  }
+  movementValidator.push(newPos, now);
 
-  auto distSqr = [](const float value) {
-    return value * value;
-  };
+  requestSync();
+  pos = newPos;
+  if (const auto goTo = std::get_if<NpcTaskGoToPoint>(&currentTask); goTo != nullptr && !goToPointReached) {
+    // Clients stand still from then on, even if the npc is moved away later
+    goToPointReached = glm::distance(Vector2(pos), Vector2(goTo->destination)) <= kArrivalRadius;
+  }
+  angle = syncPacket.Heading;
+  lastSyncReceived = now;
+  if (currentVehicle != nullptr || !(syncPacket.Fields & NpcSyncField_Velocity)) {
+    resetVelocity();
+  } else {
+    // Not trusted more than the movement validation, extrapolated moves stay within the speed limit
+    velocity = syncPacket.Velocity;
+    const auto maxSpeed = getMaxMoveSpeed();
+    if (const auto speed = glm::length(Vector2(velocity)); speed > maxSpeed) {
+      velocity.x *= maxSpeed / speed;
+      velocity.y *= maxSpeed / speed;
+    }
+    velocity.z = std::clamp(velocity.z, -kMaxFallSpeed, kMaxFallSpeed);
+  }
+  markStateChanged();
+  NpcComponent::instance().getStreamer().update(*this);
+
+  return true;
+}
 
-  if (dist > distSqr(3.f)) {
-    const auto currentPos = getPosition();
-
-    const auto currentPos2D = Vector2(currentPos);
-    const auto newPos2D = Vector2(newPos);
-    const auto dist2D = newPos2D - currentPos2D;
-    const auto dist2D_ = glm::dot(dist2D, dist2D);
-
-    if (currentPos.z < -60.f && newPos.z < -70.f && dist2D_ <= distSqr(3.f)) {
-      // if we felt under the map
-      // currentPos.z < -60.f -- if we're already below the ground for server
-      // newPos.z < -70.f -- if client is still sending some position below the ground
-      // two checkups were done to avoid immediate teleport below the ground
-
-      // Nothing to do
-    } else if (currentPos.z < -60.f && newPos.z > -20.f) {
-      // 1. current position for server: we're under the map
-      // 2. new position sent by client: we're on the map as should be
-
-      // dist_ = distance between current and new position in 2d
-      if (dist2D_ > distSqr(80.f)) {
-        // our npc teleported to the ground by the game
-        // but teleport happened too far away
-        // maybe some cheat? some bug? not sure, anyway that's something illegal
-        broadcastSync(); // resend the actual sync data
-        return false;
+void Npc::setActiveTask(const NpcTasksSet &task) {
+  if (recordingSequence) {
+    std::visit([this](const auto &task_) {
+      using Task = std::decay_t<decltype(task_)>;
+      if constexpr (!std::is_same_v<Task, NpcTaskSequence>) {
+        if (recordedSequence.steps.size() < NpcTaskSequence::kMaxSteps) {
+          recordedSequence.steps.emplace_back(task_);
+        }
       }
-    } else if (dist2D_ > distSqr(1.8f)) {
-//      NpcComponent::instance().core->logLn(LogLevel::Message, "Ignored: %0.2f", dist2D_);
-      // The overall this kind of anticheat should be done in a better way
-      // We should check the distance difference within second-two-three
-      // And ignore if distance difference in 2d was too large
-      broadcastSync(); // resend the actual sync data
-      return false;
+    }, task);
+    return;
+  }
+
+  // Scripts tend to issue the same task over and over, it's only sent again if it may have ended on the client
+  if (task == currentTask && !activeTaskMayHaveEnded()) {
+    NpcComponent::instance().recordTaskUpdate(true);
+    return;
+  }
+  currentTask = task;
+  onActiveTaskChanged();
+}
+
+bool Npc::activeTaskMayHaveEnded() const {
+  if (isTaskRestartable(currentTask)) {
+    return true;
+  }
+  if (const auto goTo = std::get_if<NpcTaskGoToPoint>(&currentTask); goTo != nullptr) {
+    return goToPointReached || glm::distance(Vector2(getPosition()), Vector2(goTo->destination)) <= kArrivalRadius;
+  }
+  return false;
+}
+
+void Npc::resetActiveTask() {
+  if (std::holds_alternative<NpcTaskStandStill>(currentTask)) {
+    return;
+  }
+  // Not through setActiveTask(), a sequence being recorded must not get it
+  currentTask = NpcTaskStandStill();
+  onActiveTaskChanged();
+}
+
+void Npc::beginTaskSequence() {
+  recordingSequence = true;
+  recordedSequence = NpcTaskSequence();
+}
+
+bool Npc::runTaskSequence(bool loop, int repeat) {
+  if (!recordingSequence) {
+    return false;
+  }
+  recordingSequence = false;
+  if (recordedSequence.steps.empty()) {
+    return false;
+  }
+
+  auto sequence = std::move(recordedSequence);
+  recordedSequence = NpcTaskSequence();
+  sequence.loop = loop;
+  sequence.repeat = static_cast<uint16_t>(std::clamp(repeat, 1, 0xFFFF));
+  setActiveTask(sequence);
+  return true;
+}
+
+int Npc::getTaskSequenceStep() const {
+  if (const auto sequence = std::get_if<NpcTaskSequence>(&currentTask); sequence != nullptr) {
+    return sequence->step;
+  }
+  return -1;
+}
+
+void Npc::onTaskTargetDestroyed(const void *target) {
+  auto &steps = recordedSequence.steps;
+  steps.erase(std::remove_if(steps.begin(), steps.end(), [target](const NpcSequenceStep &step) {
+    return taskTargetOf(step) == target;
+  }), steps.end());
+
+  auto targeted = taskTargetOf(currentTask) == target;
+  if (const auto sequence = std::get_if<NpcTaskSequence>(&currentTask); sequence != nullptr) {
+    for (const auto &step : sequence->steps) {
+      targeted |= taskTargetOf(step) == target;
     }
   }
+  if (targeted) {
+    resetActiveTask();
+  }
+}
 
-  // Allow sync packet only from the closest to npc player
-  if (sender != nullptr && !isPlayerReliableForSync(*sender)) {
+bool Npc::onTaskSequenceStepCompleted(const IPlayer &player, uint8_t step) {
+  auto sequence = std::get_if<NpcTaskSequence>(&currentTask);
+  if (sequence == nullptr || sequence->step != step) {
+    return false; // late or duplicate report
+  }
+  if (!isPlayerReliableForSync(player)) {
     return false;
   }
 
-  shouldBroadcastSyncPacket = true;
-  pos = newPos;
-  angle = syncPacket.Heading;
+  const auto running = sequence->advance();
+  if (!running) {
+    // Clients stand still after the last step by themselves, nothing to send
+    currentTask = NpcTaskStandStill();
+  }
+  // Stream ins start from the reported step
+  markStateChanged();
 
+  NpcComponent::instance().getNpcTaskDispatcher().dispatch(&NpcTaskEventHandler::onNpcTaskSequenceStep, *this, static_cast<int>(step), !running);
   return true;
 }
 
+void Npc::onActiveTaskChanged() {
+  goToPointReached = false;
+  markStateChanged();
+  markSyncAuthorityDirty(); // followed player has the priority
+  markDirty(NpcStateField_Task);
+}
+
+void Npc::broadcastRevive() {
+  // Revive carries the task, it does not have to be sent once more
+  dirtyState &= ~NpcStateField_Task;
+
+  NpcControlRpc rpc;
+  rpc.Type = NpcControlRpc::NpcControlRpcType_Revive;
+  rpc.NpcID = getID();
+  rpc.StreamIn.Health = health;
+  rpc.EncodedPayload = &getTaskPayload();
+  PacketHelper::broadcastToSome(rpc, streamedFor_.entries());
+  for (auto player : streamedFor_.entries()) {
+    NpcComponent::instance().getBandwidthBudget().charge(*player, sizeof(uint8_t) + sizeof(uint16_t) + sizeof(float) + rpc.EncodedPayload->data.size());
+  }
+}
+
 void Npc::broadcastActiveTask() {
   NpcControlRpc rpc;
   rpc.Type = NpcControlRpc::NpcControlRpcType_SetActiveTask;
   rpc.NpcID = getID();
-  rpc.StreamIn.Task = currentTask;
+  rpc.EncodedPayload = &getTaskPayload();
+  PacketHelper::broadcastToSome(rpc, streamedFor_.entries());
+  for (auto player : streamedFor_.entries()) {
+    NpcComponent::instance().getBandwidthBudget().charge(*player, sizeof(uint8_t) + sizeof(uint16_t) + rpc.EncodedPayload->data.size());
+  }
+}
+
+void Npc::broadcastPropertyUpdate(uint8_t rpcType) {
+  NpcControlRpc rpc;
+  rpc.Type = static_cast<NpcControlRpc::NpcControlRpcType>(rpcType);
+  rpc.NpcID = getID();
+  rpc.StreamIn = NpcControlRpc::StreamInData::fromNpc(*this);
   PacketHelper::broadcastToSome(rpc, streamedFor_.entries());
+  for (auto player : streamedFor_.entries()) {
+    NpcComponent::instance().getBandwidthBudget().charge(*player, rpc.getPropertyUpdateSize());
+  }
+}
+
+void Npc::markDirty(uint8_t fields) {
+  dirtyState |= fields;
+  if (updateDepth == 0 && !stateFlushQueued) {
+    stateFlushQueued = true;
+    NpcComponent::instance().queueStateFlush(*this);
+  }
 }
 
-bool Npc::isPlayerReliableForSync(const IPlayer &player) const {
+void Npc::flushStateChanges() {
+  if ((dirtyState == 0 && !revivePending) || updateDepth > 0) {
+    return;
+  }
+  if (revivePending) {
+    revivePending = false;
+    // Could have died again inside of the same update
+    if (health > 0.f) {
+      broadcastRevive();
+    }
+    if (dirtyState == 0) {
+      return;
+    }
+  }
+  const auto fields = dirtyState;
+  dirtyState = 0;
+
+  if (fields & NpcStateField_Task) {
+    NpcComponent::instance().recordTaskUpdate(false);
+  }
+  // A single change keeps its own smaller rpc
+  if (fields == NpcStateField_Task) {
+    broadcastActiveTask();
+    return;
+  }
+  for (auto i = 0; i < NpcStateField_PropertyCount; ++i) {
+    if (fields == (1 << i)) {
+      broadcastPropertyUpdate(NpcControlRpc::NpcControlRpcType_SetSkin + i);
+      return;
+    }
+  }
+
+  NpcControlRpc rpc;
+  rpc.Type = NpcControlRpc::NpcControlRpcType_UpdateState;
+  rpc.NpcID = getID();
+  rpc.StateFields = fields;
+  rpc.StreamIn = NpcControlRpc::StreamInData::fromNpc(*this);
+  if (fields & NpcStateField_Task) {
+    rpc.EncodedPayload = &getTaskPayload();
+  }
+  PacketHelper::broadcastToSome(rpc, streamedFor_.entries());
+  for (auto player : streamedFor_.entries()) {
+    NpcComponent::instance().getBandwidthBudget().charge(*player, rpc.getUpdateStateSize());
+  }
+}
+
+void Npc::beginUpdate() {
+  ++updateDepth;
+}
+
+void Npc::commitUpdate() {
+  if (updateDepth == 0) {
+    return;
+  }
+  if (--updateDepth == 0) {
+    flushStateChanges();
+  }
+}
+
+void Npc::markStateChanged() {
+  // 0 is reserved for payloads which were never written
+  if (++stateVersion == 0) {
+    stateVersion = 1;
+  }
+}
+
+const NpcEncodedPayload &Npc::getStreamInPayload() {
+  return encodeOnce(streamInPayload, stateVersion, [this](NetworkBitStream &bs) {
+    NpcControlRpc::StreamInData::fromNpc(*this).write(bs);
+  });
+}
+
+const NpcEncodedPayload &Npc::getTaskPayload() {
+  return encodeOnce(taskPayload, stateVersion, [this](NetworkBitStream &bs) {
+    std::visit([&bs](const auto &task) { task.writeInternal(bs); }, currentTask);
+  });
+}
+
+const NpcEncodedPayload &Npc::getSyncPayload(uint8_t fields) {
+  return encodeOnce(syncPayloads[fields & NpcSyncField_All], stateVersion, [this, fields](NetworkBitStream &bs) {
+    NpcSyncPacket data;
+    data.NpcID = getID();
+    data.Position = pos;
+    data.Heading = angle;
+    data.Health = health;
+    data.VehicleId = currentVehicle != nullptr ? currentVehicle->getID() : INVALID_VEHICLE_ID;
+    data.VehicleSeatIndex = currentVehicle != nullptr ? currentVehicleSeat : 0;
+    data.Fields = fields;
+    data.writeEntry(bs);
+  });
+}
+
+bool Npc::isPlayerReliableForSync(const IPlayer &player) {
   if (!isStreamedInForPlayer(player)) {
     return false;
   }
-  if (streamedFor_.entries().size() == 1) {
-    return true;
+  const auto authority = getSyncAuthority();
+  return authority == nullptr || authority->getID() == player.getID();
+}
+
+const IPlayer *Npc::getSyncAuthority() {
+  const auto now = Time::now();
+  if (syncAuthorityDirty || now - syncAuthorityElectedAt >= NpcComponent::instance().getSyncAuthorityInterval()) {
+    const auto elected = electSyncAuthority();
+    syncAuthorityElectedAt = now;
+    syncAuthorityDirty = false;
+    if (elected != syncAuthority) {
+      NpcComponent::instance().onSyncAuthorityChanged(syncAuthority, elected);
+      syncAuthority = elected;
+      // Clients are told by the tick, stream ins have been sent by then
+      queueSyncAuthorityUpdate();
+    }
+  }
+  return syncAuthority;
+}
+
+void Npc::markSyncAuthorityDirty() {
+  syncAuthorityDirty = true;
+  queueSyncAuthorityUpdate();
+}
+
+void Npc::queueSyncAuthorityUpdate() {
+  if (!syncAuthorityQueued) {
+    syncAuthorityQueued = true;
+    NpcComponent::instance().queueSyncAuthorityUpdate(*this);
   }
+}
+
+void Npc::updateSyncOwners() {
+  // Still flagged as queued, so a changed election does not queue the npc once again
+  const auto authority = getSyncAuthority();
+  syncAuthorityQueued = false;
+
+  auto sendOwnership = [this](IPlayer &player, bool owner) {
+    NpcControlRpc rpc;
+    rpc.Type = NpcControlRpc::NpcControlRpcType_SetSyncOwner;
+    rpc.NpcID = getID();
+    rpc.SyncOwner = owner;
+    PacketHelper::send(rpc, player);
+    NpcComponent::instance().getBandwidthBudget().charge(player, sizeof(uint8_t) * 2 + sizeof(uint16_t));
+  };
+
+  // Handoff: the old owner stops uploading first, its late syncs are rejected by the authority check anyway
+  // Nobody elected = every streamed player uploads until one of them gets verified
+  for (const auto pass : {false, true}) {
+    for (auto player : streamedFor_.entries()) {
+      const auto owner = authority == nullptr || authority->getID() == player->getID();
+      auto &link = syncLinks[player->getID()];
+      if (owner == pass && link.syncOwner != owner) {
+        link.syncOwner = owner;
+        sendOwnership(*player, owner);
+      }
+    }
+  }
+}
+
+const IPlayer *Npc::electSyncAuthority() const {
+  const auto &entries = streamedFor_.entries();
+  if (entries.size() == 1) {
+    return *entries.begin();
+  }
+  const auto &component = NpcComponent::instance();
+  auto isEligible = [this, &component](const IPlayer &player) {
+    return isStreamedInForPlayer(player) && !component.isPlayerAfk(player) && verifiedSupportedPlayers_.valid(player.getID());
+  };
+
   const IPlayer *prioritizedPlayer = nullptr;
   if (const auto task = std::get_if<NpcTaskFollowPlayer>(&currentTask); task != nullptr) {
     prioritizedPlayer = task->target;
@@ -384,30 +933,43 @@ bool Npc::isPlayerReliableForSync(const IPlayer &player) const {
   if (manuallyInstalledReliablePlayer != nullptr) {
     prioritizedPlayer = manuallyInstalledReliablePlayer;
   }
-  if (prioritizedPlayer != nullptr
-      && (NpcComponent::instance().isPlayerAfk(*prioritizedPlayer) || !isStreamedInForPlayer(*prioritizedPlayer) || !verifiedSupportedPlayers_.valid(prioritizedPlayer->getID()))
-      ) {
-    prioritizedPlayer = nullptr; // well, yeah
+  if (prioritizedPlayer != nullptr && isEligible(*prioritizedPlayer)) {
+    return prioritizedPlayer;
   }
 
-  if (prioritizedPlayer != nullptr) {
-    if (player.getID() != prioritizedPlayer->getID()) {
-      return false;
+  // Score is in meters: distance plus penalties for ping, client load and npcs already owned
+  // The current owner gets a bonus, so close scores do not hand the npc over back and forth
+  const auto &weights = component.getOwnershipWeights();
+  const IPlayer *best = nullptr;
+  const IPlayer *bestCapped = nullptr; // used only if every candidate is at the cap
+  auto bestScore = 0.f;
+  auto bestCappedScore = 0.f;
+  for (const auto player : entries) {
+    if (!isEligible(*player)) {
+      continue;
     }
-  } else {
+    const auto isOwner = syncAuthority != nullptr && syncAuthority->getID() == player->getID();
+    // Npcs owned besides this one
+    const auto owned = component.getOwnedNpcsCount(*player) - (isOwner ? 1 : 0);
     // player in spectator shouldn't have the same rights to send sync, instead, prioritize non-spectating ones
-    const auto distFromPlayer = glm::distance(player.getPosition(), pos) + ((player.getState() == PlayerState_Spectating) ? 5.f : 0.f);
-    const auto &entries = streamedFor_.entries();
-    for (const auto comparable : entries) {
-      if (comparable->getID() == player.getID() || NpcComponent::instance().isPlayerAfk(*comparable) || !verifiedSupportedPlayers_.valid(comparable->getID())) {
-        continue;
-      }
-      // player in spectator shouldn't have the same rights to send sync, instead, prioritize non-spectating one
-      const auto otherDist = glm::distance(comparable->getPosition(), pos) + ((comparable->getState() == PlayerState_Spectating) ? 5.f : 0.f);
-      if (otherDist < distFromPlayer) {
-        return false;
+    auto score = glm::distance(player->getPosition(), pos) + ((player->getState() == PlayerState_Spectating) ? 5.f : 0.f);
+    score += weights.ping * static_cast<float>(player->getPing());
+    score += weights.load * static_cast<float>(component.getPlayerLoad(*player));
+    score += weights.owned * static_cast<float>(owned);
+    if (isOwner) {
+      score -= weights.stickiness;
+    }
+
+    if (weights.maxOwnedPerPlayer != 0 && owned >= weights.maxOwnedPerPlayer) {
+      if (bestCapped == nullptr || score < bestCappedScore) {
+        bestCapped = player;
+        bestCappedScore = score;
       }
+    } else if (best == nullptr || score < bestScore) {
+      best = player;
+      bestScore = score;
     }
   }
-  return true;
+  // Nobody eligible = anyone may send until somebody gets verified
+  return best != nullptr ? best : bestCapped;
 }
@@ -6,6 +6,8 @@
 #include <network.hpp>
 #include <packet.hpp>
 
+#include "NpcMovementValidator.h"
+
 using namespace Impl;
 
 enum NpcWeaponSkillType {
@@ -20,6 +22,34 @@ enum NpcMoveMode {
   NpcMoveMode_Sprint
 };
 
+/// Fields of npc sync sent to players, only the changed ones are written
+enum NpcSyncField : uint8_t {
+  NpcSyncField_Position = 1 << 0,
+  NpcSyncField_Heading = 1 << 1,
+  NpcSyncField_Health = 1 << 2,
+  NpcSyncField_Vehicle = 1 << 3, ///< vehicle id and seat
+  NpcSyncField_Velocity = 1 << 4, ///< uploaded by clients only, see Npc::getPosition()
+
+  NpcSyncField_All = NpcSyncField_Position | NpcSyncField_Heading | NpcSyncField_Health | NpcSyncField_Vehicle,
+
+  NpcSyncField_Quantized = 1 << 7, ///< not a field, position and heading are written by NpcSyncQuantizer
+};
+
+/// Npc state changed since the last flush, see Npc::flushStateChanges()
+/// Property bits follow the order of NpcControlRpc property update types, starting at NpcControlRpcType_SetSkin
+enum NpcStateField : uint8_t {
+  NpcStateField_Skin = 1 << 0,
+  NpcStateField_Weapon = 1 << 1,
+  NpcStateField_WeaponAccuracy = 1 << 2,
+  NpcStateField_WeaponShootingRate = 1 << 3,
+  NpcStateField_WeaponSkill = 1 << 4,
+  NpcStateField_StunAnimation = 1 << 5,
+  NpcStateField_Heading = 1 << 6,
+  NpcStateField_Task = 1 << 7,
+
+  NpcStateField_PropertyCount = 7,
+};
+
 struct INpc : public IExtensible, public IEntity {
   /// Checks if player has the npc streamed in for themselves
   virtual bool isStreamedInForPlayer(const IPlayer &player) const = 0;
@@ -112,10 +142,69 @@ struct INpc : public IExtensible, public IEntity {
 
   /// Get the previously installed as raliable player
   virtual IPlayer *getReliablePlayerForSync() const = 0;
+
+  /// Set the npc streaming priority
+  /// Npcs with higher priority are streamed in first when players reach their streamed npcs limit
+  virtual void setStreamPriority(int priority) = 0;
+
+  /// Get the npc streaming priority
+  virtual int getStreamPriority() const = 0;
+
+  /// Set the distance the npc is streamed in from
+  /// 0 = use the server one
+  virtual void setStreamRadius(float radius) = 0;
+
+  /// Get the npc own stream radius, 0 if the server one is used
+  virtual float getStreamRadius() const = 0;
+
+  /// Changes made after that are held back until commitUpdate(), calls may be nested
+  /// Without it changes are still sent once per server tick
+  virtual void beginUpdate() = 0;
+
+  /// Sends the changes made since beginUpdate() right away, as a single update per player
+  virtual void commitUpdate() = 0;
+
+  /// Tasks given after that are recorded as steps of a sequence instead of being run
+  virtual void beginTaskSequence() = 0;
+
+  /// Runs the steps recorded since beginTaskSequence() on clients, one after another
+  /// repeat is how many times the steps are run if not looped
+  virtual bool runTaskSequence(bool loop, int repeat) = 0;
+
+  /// Get the step of the running sequence, -1 if there is no sequence
+  virtual int getTaskSequenceStep() const = 0;
 };
 
 #include "NpcTask.hpp"
 
+/// Npc sync state a streamed player has got last time
+struct NpcSyncLink {
+  bool hasBaseline = false; ///< false = everything is sent
+  Vector3 pos;
+  float heading = 0.f;
+  float health = 0.f;
+  int vehicleId = INVALID_VEHICLE_ID;
+  int vehicleSeat = 0;
+  TimePoint lastKeyframe; ///< sync packets may be lost, so everything is sent once in a while
+  TimePoint nextSync; ///< far players get syncs less often, see NpcComponent::getSyncInterval()
+  bool keyframePending = false; ///< keyframe was forced but did not fit into the player bandwidth budget
+  float priority = 0.f; ///< grows while the player waits for a sync, see Npc::sendSync()
+  TimePoint lastPriorityUpdate;
+  TimePoint lastCorrection;
+  bool syncOwner = false; ///< what the player was told by NpcControlRpcType_SetSyncOwner, false on stream in
+};
+
+/// Bytes written once for an npc state version, then copied into every packet carrying them
+struct NpcEncodedPayload {
+  uint32_t version = 0; ///< Npc::stateVersion the bytes were written for, 0 = nothing written yet
+  DynamicArray<uint8_t> data;
+  uint32_t bits = 0;
+
+  void write(NetworkBitStream &bs) const {
+    bs.WriteBits(data.data(), bits, false);
+  }
+};
+
 class Npc : public INpc,
             public PoolIDProvider,
             public NoCopy {
@@ -125,15 +214,64 @@ class Npc : public INpc,
 public:
   Npc(int skin, Vector3 position, bool* allAnimationLibraries, bool* validateAnimations);
 
-  void restream();
   void destream();
   void streamInForClient(IPlayer &player);
   void streamOutForClient(IPlayer &player);
-  void broadcastSyncIfRequired(Milliseconds onfootSyncRate);
-  void broadcastSync();
+  /// Sync is sent once onfoot sync rate allows, see NpcComponent::scheduleSync()
+  void requestSync();
+  /// Sync is sent at the end of the tick, see NpcComponent::flushSyncBatches()
+  void broadcastSync(bool keyframe = false);
+  void sendSync();
+  /// Sync queued by sendSync() has made it into the player bandwidth budget
+  void onSyncSent(const IPlayer &player, const struct NpcSyncPacket &packet, TimePoint now);
+  /// Sync queued by sendSync() did not fit into the budget, it's tried again later
+  void onSyncDeferred(const IPlayer &player, const struct NpcSyncPacket &packet);
+  /// Keyframe sent only to the player whose sync was rejected, rate limited per player
+  void sendCorrection(IPlayer &player, TimePoint now);
   bool updateFromSync(const struct NpcSyncPacket &syncPacket, IPlayer *sender = nullptr);
+  /// Horizontal speed limit of the current task move mode, m/s
+  float getMaxMoveSpeed() const;
+  bool validateMovement(const Vector3 &newPos, TimePoint now);
+  /// Position is moved along the last synced velocity for a while, see getPosition()
+  bool isExtrapolating() const;
+  void resetVelocity();
   void broadcastActiveTask();
-  bool isPlayerReliableForSync(const IPlayer &player) const;
+  /// Sends the changed property alone instead of restreaming the npc, rpcType is NpcControlRpc::NpcControlRpcType
+  void broadcastPropertyUpdate(uint8_t rpcType);
+  /// Same task as the current one is not sent again, see NpcComponent::getTaskUpdateStats()
+  void setActiveTask(const NpcTasksSet &task);
+  /// Active task could be done on the client while still being current here, issuing it again is not a no-op then
+  bool activeTaskMayHaveEnded() const;
+  /// Task target is gone, the npc stands still then
+  void resetActiveTask();
+  void onActiveTaskChanged();
+  /// Player or npc the task or any sequence step points to is gone, the npc stands still then
+  void onTaskTargetDestroyed(const void *target);
+  /// Sync owner has completed the step, false if it's not the step in progress
+  bool onTaskSequenceStepCompleted(const IPlayer &player, uint8_t step);
+  /// Health and the active task in one rpc, clients bring the dead ped back in place
+  void broadcastRevive();
+  /// Changed fields are sent by the end of the tick, see NpcComponent::flushStateChanges()
+  void markDirty(uint8_t fields);
+  /// One rpc per player for everything changed, nothing is sent inside of beginUpdate()
+  void flushStateChanges();
+
+  /// Anything sent to clients has changed, cached payloads are written again when needed
+  void markStateChanged();
+  const NpcEncodedPayload &getStreamInPayload();
+  const NpcEncodedPayload &getTaskPayload();
+  /// Sync entry without the packet id, fields is a NpcSyncField mask
+  const NpcEncodedPayload &getSyncPayload(uint8_t fields);
+  /// Single id compare against the cached authority, see getSyncAuthority()
+  bool isPlayerReliableForSync(const IPlayer &player);
+  /// Player whose syncs are accepted, nullptr = anyone streamed
+  /// Elected again when streamed or verified players change, and every NpcComponent::getSyncAuthorityInterval()
+  const IPlayer *getSyncAuthority();
+  const IPlayer *electSyncAuthority() const;
+  void markSyncAuthorityDirty();
+  void queueSyncAuthorityUpdate();
+  /// Tells streamed players whether they own the npc sync, only owners upload it
+  void updateSyncOwners();
 
   // Inherited from INpc
   bool isStreamedInForPlayer(const IPlayer &player) const override;
@@ -165,6 +303,15 @@ public:
   void playAnimation(const AnimationData &animation) override;
   void setReliablePlayerForSync(IPlayer *player) override;
   IPlayer *getReliablePlayerForSync() const override;
+  void setStreamPriority(int priority) override;
+  int getStreamPriority() const override;
+  void setStreamRadius(float radius) override;
+  float getStreamRadius() const override;
+  void beginUpdate() override;
+  void commitUpdate() override;
+  void beginTaskSequence() override;
+  bool runTaskSequence(bool loop, int repeat) override;
+  int getTaskSequenceStep() const override;
 
   // Inherited from IEntity -> IIDProvider
   int getID() const override;
@@ -193,14 +340,53 @@ public:
   NpcWeaponSkillType weaponSkill;
 
   NpcTasksSet currentTask;
+  bool goToPointReached = false; // a sync got to the destination of the active go to point task
+  bool recordingSequence = false;
+  NpcTaskSequence recordedSequence;
 
   TimePoint lastSyncBroadcast;
-  bool shouldBroadcastSyncPacket;
+  NpcMovementValidator movementValidator;
+  Vector3 velocity = Vector3(0.f); // m/s, reported by the sync owner
+  TimePoint lastSyncReceived;
+  FlatHashMap<int, NpcSyncLink> syncLinks; // by streamed player id
+  bool syncQueued = false;
+  bool syncKeyframeQueued = false;
+
+  uint8_t dirtyState = 0; // NpcStateField mask
+  bool revivePending = false; // health was set on a dead npc, see flushStateChanges()
+  bool stateFlushQueued = false;
+  int updateDepth = 0; // beginUpdate() nesting
+
+  uint32_t stateVersion = 1;
+  NpcEncodedPayload streamInPayload;
+  NpcEncodedPayload taskPayload;
+  StaticArray<NpcEncodedPayload, NpcSyncField_All + 1> syncPayloads; // by field mask
 
   IVehicle* currentVehicle;
   int8_t currentVehicleSeat;
 
   const IPlayer* manuallyInstalledReliablePlayer = nullptr;
+  const IPlayer* syncAuthority = nullptr;
+  TimePoint syncAuthorityElectedAt;
+  bool syncAuthorityDirty = true;
+  bool syncAuthorityQueued = false;
+
+  int streamPriority = 0;
+  float streamRadius = 0.f;
+
+  // NpcStreamer grid bookkeeping
+  uint64_t gridCell = 0;
+  int gridCellZ = 0;
+  int gridSlot = -1;
+  uint64_t gridEpoch = 0; // streamer epoch of the last cell boundary crossing
+  bool gridFar = false; // stream radius goes beyond the cells around a player
+
+  // NpcSyncScheduler bookkeeping
+  Npc *syncNext = nullptr;
+  Npc *syncPrev = nullptr;
+  TimePoint syncDue;
+  size_t syncSlot = 0;
+  bool syncScheduled = false;
 
   UniqueIDArray<IPlayer, PLAYER_POOL_SIZE> streamedFor_;
   UniqueIDArray<IPlayer, PLAYER_POOL_SIZE> verifiedSupportedPlayers_; // players who have sent npc sync once at least
@@ -0,0 +1,67 @@
+#include "NpcBandwidthBudget.h"
+
+void NpcBandwidthBudget::setBytesPerSecond(int bytes) {
+  bytesPerSecond = std::max(0, bytes);
+}
+
+int NpcBandwidthBudget::getBytesPerSecond() const {
+  return bytesPerSecond;
+}
+
+NpcBandwidthBudget::PlayerBudget &NpcBandwidthBudget::getBudget(const IPlayer &player, TimePoint now) {
+  auto &budget = budgets[player.getID()];
+  if (now - budget.secondStart >= Seconds(1)) {
+    // A second without any traffic leaves nothing to report
+    budget.last = now - budget.secondStart >= Seconds(2) ? NpcBandwidthUsage() : budget.current;
+    budget.current = NpcBandwidthUsage();
+    budget.secondStart = now;
+  }
+  return budget;
+}
+
+void NpcBandwidthBudget::refill(const IPlayer &player, TimePoint now) {
+  auto &budget = getBudget(player, now);
+  if (bytesPerSecond == 0) {
+    return;
+  }
+  const auto elapsed = std::chrono::duration<float>(now - budget.lastRefill).count();
+  const auto burst = bytesPerSecond * kBurstSeconds;
+  budget.tokens = std::min(burst, budget.tokens + elapsed * bytesPerSecond);
+  budget.lastRefill = now;
+}
+
+bool NpcBandwidthBudget::trySpend(const IPlayer &player, size_t bytes) {
+  auto &budget = budgets[player.getID()];
+  if (bytesPerSecond != 0) {
+    if (budget.tokens < static_cast<float>(bytes)) {
+      return false;
+    }
+    budget.tokens -= static_cast<float>(bytes);
+  }
+  budget.current.bytes += bytes;
+  return true;
+}
+
+void NpcBandwidthBudget::charge(const IPlayer &player, size_t bytes) {
+  auto &budget = getBudget(player, Time::now());
+  if (bytesPerSecond != 0) {
+    budget.tokens -= static_cast<float>(bytes);
+  }
+  budget.current.bytes += bytes;
+}
+
+void NpcBandwidthBudget::recordDeferred(const IPlayer &player, size_t count) {
+  budgets[player.getID()].current.deferred += count;
+}
+
+NpcBandwidthUsage NpcBandwidthBudget::getUsage(const IPlayer &player, TimePoint now) const {
+  const auto &budget = budgets[player.getID()];
+  if (now - budget.secondStart >= Seconds(2)) {
+    return NpcBandwidthUsage();
+  }
+  return now - budget.secondStart >= Seconds(1) ? budget.current : budget.last;
+}
+
+void NpcBandwidthBudget::removePlayer(const IPlayer &player) {
+  budgets[player.getID()] = PlayerBudget();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <Server/Components/Pawn/pawn.hpp>
+
+#include <Impl/pool_impl.hpp>
+
+using namespace Impl;
+
+/// Npc traffic sent to a player over the last full second
+struct NpcBandwidthUsage {
+  uint64_t bytes = 0;
+  uint64_t deferred = 0; ///< syncs which did not fit into the budget
+};
+
+/// Per-player token bucket for npc traffic
+/// Syncs are deferrable and spend only what is left, reliable rpcs are always charged and may put the bucket in debt
+class NpcBandwidthBudget {
+public:
+  /// Bucket holds at most this much of a second worth of bytes, limits bursts after quiet periods
+  static constexpr float kBurstSeconds = 0.25f;
+
+  /// 0 = no limit, usage is counted anyway
+  void setBytesPerSecond(int bytes);
+  int getBytesPerSecond() const;
+
+  /// Should be called before spending for the player in the current tick
+  void refill(const IPlayer &player, TimePoint now);
+  /// Returns false and spends nothing if there is not enough left
+  bool trySpend(const IPlayer &player, size_t bytes);
+  void charge(const IPlayer &player, size_t bytes);
+  void recordDeferred(const IPlayer &player, size_t count);
+
+  NpcBandwidthUsage getUsage(const IPlayer &player, TimePoint now) const;
+  void removePlayer(const IPlayer &player);
+
+private:
+  struct PlayerBudget {
+    float tokens = 0.f;
+    TimePoint lastRefill;
+    TimePoint secondStart;
+    NpcBandwidthUsage current;
+    NpcBandwidthUsage last;
+  };
+
+  PlayerBudget &getBudget(const IPlayer &player, TimePoint now);
+
+  int bytesPerSecond = 0;
+  StaticArray<PlayerBudget, PLAYER_POOL_SIZE> budgets;
+};
@@ -7,6 +7,12 @@
 
 #include "NpcNetwork.hpp"
 
+struct NpcComponent::QueuedSync {
+  NpcSyncPacket packet;
+  Npc *npc;
+  float priority;
+};
+
 StringView NpcComponent::componentName() const {
   return COMPONENT_NAME;
 }
@@ -20,6 +26,39 @@ void NpcComponent::onLoad(ICore *c) {
   players = &core->getPlayers();
   streamConfigHelper = StreamConfigHelper(core->getConfig());
   onfootSyncRate = Milliseconds(*core->getConfig().getInt("network.on_foot_sync_rate"));
+  syncKeyframeInterval = Milliseconds(*core->getConfig().getInt("npcs.sync_keyframe_interval"));
+  syncCorrectionInterval = Milliseconds(*core->getConfig().getInt("npcs.sync_correction_interval"));
+  syncAuthorityInterval = Milliseconds(*core->getConfig().getInt("npcs.sync_authority_interval"));
+  ownershipWeights.maxOwnedPerPlayer = std::max(0, *core->getConfig().getInt("npcs.owner_max_per_player"));
+  ownershipWeights.ping = *core->getConfig().getFloat("npcs.owner_ping_weight");
+  ownershipWeights.load = *core->getConfig().getFloat("npcs.owner_load_weight");
+  ownershipWeights.owned = *core->getConfig().getFloat("npcs.owner_owned_weight");
+  ownershipWeights.stickiness = *core->getConfig().getFloat("npcs.owner_stickiness");
+  syncQuantized = *core->getConfig().getBool("npcs.sync_quantization");
+  bandwidthBudget.setBytesPerSecond(*core->getConfig().getInt("npcs.player_bandwidth_budget"));
+  // Tier distance of 0 disables the tier
+  const auto loadSyncLodTier = [this](size_t index, StringView distanceKey, StringView rateKey) {
+    const auto distance = std::max(0.f, *core->getConfig().getFloat(distanceKey));
+    syncLodTiers[index].distanceSqr = distance > 0.f ? distance * distance : std::numeric_limits<float>::max();
+    syncLodTiers[index].rateDivisor = std::max(1, *core->getConfig().getInt(rateKey));
+  };
+  loadSyncLodTier(0, "npcs.sync_lod_mid_distance", "npcs.sync_lod_mid_rate_divisor");
+  loadSyncLodTier(1, "npcs.sync_lod_far_distance", "npcs.sync_lod_far_rate_divisor");
+  streamer.setMaxStreamedPerPlayer(std::max(0, *core->getConfig().getInt("npcs.max_streamed_per_player")));
+  // Stream in radius falls back to the server one, out radius keeps a margin over it to avoid flapping
+  auto inRadius = *core->getConfig().getFloat("npcs.stream_in_radius");
+  auto outRadius = *core->getConfig().getFloat("npcs.stream_out_radius");
+  if (inRadius <= 0.f) {
+    inRadius = std::sqrt(streamConfigHelper.getDistanceSqr());
+  }
+  if (outRadius <= 0.f) {
+    outRadius = inRadius * 1.1f;
+  }
+  streamer.setStreamRadii(inRadius, outRadius);
+  streamer.setMinResidency(Milliseconds(*core->getConfig().getInt("npcs.stream_min_residency")));
+  streamer.setStreamInsPerTick(std::max(0, *core->getConfig().getInt("npcs.stream_ins_per_tick")));
+  streamer.setThreads(std::max(0, *core->getConfig().getInt("npcs.stream_threads")));
+  streamer.setParallelVerification(*core->getConfig().getBool("npcs.stream_threads_verify") ? core : nullptr);
   setAmxLookups(core);
 
   core->getEventDispatcher().addEventHandler(this, EventPriority_FairlyLow);
@@ -31,9 +70,52 @@ void NpcComponent::onLoad(ICore *c) {
   players->getPoolEventDispatcher().addEventHandler(this);
 
   getNpcDamageDispatcher().addEventHandler(this);
+  getNpcTaskDispatcher().addEventHandler(this);
   getPoolEventDispatcher().addEventHandler(this);
 }
 
+void NpcComponent::provideConfiguration(ILogger &logger, IEarlyConfig &config, bool defaults) {
+  auto setIntIfMissing = [&](StringView key, int value) {
+    if (defaults || config.getType(key) == ConfigOptionType_None) {
+      config.setInt(key, value);
+    }
+  };
+
+  auto setFloatIfMissing = [&](StringView key, float value) {
+    if (defaults || config.getType(key) == ConfigOptionType_None) {
+      config.setFloat(key, value);
+    }
+  };
+
+  auto setBoolIfMissing = [&](StringView key, bool value) {
+    if (defaults || config.getType(key) == ConfigOptionType_None) {
+      config.setBool(key, value);
+    }
+  };
+
+  setIntIfMissing("npcs.max_streamed_per_player", 0); // 0 = no limit
+  setFloatIfMissing("npcs.stream_in_radius", 0.f); // 0 = network.stream_radius
+  setFloatIfMissing("npcs.stream_out_radius", 0.f); // 0 = 110% of the stream in radius
+  setIntIfMissing("npcs.stream_min_residency", 2000); // ms
+  setIntIfMissing("npcs.sync_keyframe_interval", 1000); // ms, every sync field is resent this often
+  setIntIfMissing("npcs.sync_correction_interval", 250); // ms, min time between corrections of an npc sent to the same player
+  setIntIfMissing("npcs.sync_authority_interval", 500); // ms, the closest player is elected again this often
+  setIntIfMissing("npcs.owner_max_per_player", 24); // npcs a single client simulates, 0 = no limit
+  setFloatIfMissing("npcs.owner_ping_weight", 0.05f); // meters per ms of ping
+  setFloatIfMissing("npcs.owner_load_weight", 0.2f); // meters per point of reported client load
+  setFloatIfMissing("npcs.owner_owned_weight", 1.f); // meters per npc already owned
+  setFloatIfMissing("npcs.owner_stickiness", 8.f); // meters, keeps the current owner unless another one is clearly better
+  setBoolIfMissing("npcs.sync_quantization", false); // fixed point position and heading, clients follow the server
+  setIntIfMissing("npcs.player_bandwidth_budget", 0); // bytes per second of npc traffic for a single player, 0 = no limit
+  setFloatIfMissing("npcs.sync_lod_mid_distance", 60.f); // 0 = every player gets every sync
+  setIntIfMissing("npcs.sync_lod_mid_rate_divisor", 2); // half rate
+  setFloatIfMissing("npcs.sync_lod_far_distance", 120.f); // 0 = no far tier
+  setIntIfMissing("npcs.sync_lod_far_rate_divisor", 4); // quarter rate
+  setIntIfMissing("npcs.stream_ins_per_tick", 16); // 0 = no limit
+  setIntIfMissing("npcs.stream_threads", 0); // 0 = stream on the server thread
+  setBoolIfMissing("npcs.stream_threads_verify", false); // compare parallel passes against serial ones, debug only
+}
+
 void NpcComponent::onInit(IComponentList *components) {
   auto pawnComponent_ = components->queryComponent<IPawnComponent>();
   if (pawnComponent_ != nullptr) {
@@ -71,10 +153,27 @@ void NpcComponent::onFree(IComponent *component) {
 }
 
 void NpcComponent::reset() {
+  for (auto npc : storage) {
+    dynamic_cast<Npc&>(*npc).destream();
+  }
+  flushStreamBatches();
+
+  syncScheduler.clear();
+  syncAuthorityQueue.clear();
+  stateFlushQueue.clear();
+  ownedNpcsCount.fill(0);
+  syncQueue.clear();
+  for (auto player : playersWithSyncBatch) {
+    syncBatches[player->getID()].clear();
+  }
+  playersWithSyncBatch.clear();
   storage.clear();
+  streamer.clear();
 }
 
 void NpcComponent::free() {
+  streamer.setThreads(0);
+
   if (core != nullptr) {
     core->getEventDispatcher().removeEventHandler(this);
 
@@ -93,15 +192,13 @@ void NpcComponent::free() {
   }
 
   getNpcDamageDispatcher().removeEventHandler(this);
+  getNpcTaskDispatcher().removeEventHandler(this);
   getPoolEventDispatcher().removeEventHandler(this);
 }
 
 bool NpcComponent::onPlayerUpdate(IPlayer &player, TimePoint now) {
   if (streamConfigHelper.shouldStream(player.getID(), now)) {
-    const auto maxDist = streamConfigHelper.getDistanceSqr();
-    for (auto npc : storage) {
-      updateNpcStateForPlayer(dynamic_cast<Npc&>(*npc), player, maxDist);
-    }
+    streamer.requestPass(player);
   }
   if (player.getState() != PlayerState_None) {
     lastPlayersUpdateSend[player.getID()] = now;
@@ -110,15 +207,30 @@ bool NpcComponent::onPlayerUpdate(IPlayer &player, TimePoint now) {
 }
 
 void NpcComponent::onPoolEntryDestroyed(IPlayer &player) {
-  for (auto npc : storage) {
+  DynamicArray<Npc *> streamedNpcs;
+  for (const auto &[npc, streamedAt] : streamer.getStreamedNpcs(player)) {
+    streamedNpcs.push_back(npc);
+  }
+  for (auto npc : streamedNpcs) {
     npc->streamOutForPlayer(player);
+  }
+  streamer.removePlayer(player);
+  bandwidthBudget.removePlayer(player);
+  playersLoad[player.getID()] = 0;
+  correctionStats[player.getID()] = NpcCorrectionStats();
+
+  if (auto &batch = streamBatches[player.getID()]; !batch.streamIn.empty() || !batch.streamOut.empty()) {
+    batch = StreamBatch();
+    playersWithStreamBatch.erase(std::find(playersWithStreamBatch.begin(), playersWithStreamBatch.end(), &player));
+  }
+  if (auto &batch = syncBatches[player.getID()]; !batch.empty()) {
+    batch.clear();
+    playersWithSyncBatch.erase(std::find(playersWithSyncBatch.begin(), playersWithSyncBatch.end(), &player));
+  }
 
+  for (auto npc : storage) {
     auto &npc_ = dynamic_cast<Npc&>(*npc);
-    if (const auto task = std::get_if<NpcTaskAttackPlayer>(&npc_.currentTask); task != nullptr && task->target == &player) {
-      npc->standStill();
-    } else if (const auto task = std::get_if<NpcTaskFollowPlayer>(&npc_.currentTask); task != nullptr && task->target == &player) {
-      npc->standStill();
-    }
+    npc_.onTaskTargetDestroyed(&player);
 
     if (npc->getReliablePlayerForSync() == &player) {
       npc->setReliablePlayerForSync(nullptr);
@@ -136,18 +248,31 @@ void NpcComponent::onPoolEntryDestroyed(IVehicle &vehicle) {
 
 void NpcComponent::onPoolEntryDestroyed(INpc &destroyed) {
   for (auto npc : storage) {
-    auto &npc_ = dynamic_cast<Npc&>(*npc);
-    if (const auto task = std::get_if<NpcTaskAttackNpc>(&npc_.currentTask); task != nullptr && task->target == &destroyed) {
-      npc->standStill();
-    }
+    dynamic_cast<Npc&>(*npc).onTaskTargetDestroyed(&destroyed);
   }
 }
 
 void NpcComponent::onTick(Microseconds elapsed, TimePoint now) {
-  for (auto npc : storage) {
-    auto &npc_ = dynamic_cast<Npc&>(*npc);
-    npc_.broadcastSyncIfRequired(onfootSyncRate);
+  streamer.updateMovingNpcs();
+  streamer.processPasses(now);
+  streamer.drainStreamInQueues();
+
+  // Only npcs which have changed and are due are touched
+  syncScheduler.collectDue(now, dueSyncs);
+  for (auto npc : dueSyncs) {
+    npc->lastSyncBroadcast = now;
+    npc->broadcastSync();
   }
+  dueSyncs.clear();
+
+  // Property updates of npcs being streamed in are sent first and ignored, stream ins have got them already
+  flushStateChanges();
+  flushStreamBatches();
+  updateSyncAuthorities(now);
+  flushSyncBatches();
+
+  lastTickEncodeStats = tickEncodeStats;
+  tickEncodeStats = NpcEncodeStats();
 }
 
 bool NpcComponent::onPlayerGiveDamageNpc(INpc &npc, IPlayer &from, float amount, unsigned int weapon, BodyPart part) {
@@ -222,22 +347,16 @@ void NpcComponent::onNpcDeath(INpc &npc, IPlayer *killer, int reason) {
   }
 }
 
-void NpcComponent::updateNpcStateForPlayer(Npc &npc, IPlayer &player, float maxDist) {
-  const auto world = npc.getVirtualWorld();
-  const auto pos = npc.getPosition();
-
-  const auto playerState = player.getState();
-  const auto playerWorld = player.getVirtualWorld();
-  const auto dist3D = pos - player.getPosition();
-  const auto dist = glm::dot(dist3D, dist3D);
+void NpcComponent::onNpcTaskSequenceStep(INpc &npc, int step, bool finished) {
+  static constexpr auto publicName = "OnNpcTaskSequenceStep";
 
-  const auto shouldBeStreamedIn = playerState != PlayerState_None && world == playerWorld && dist < maxDist;
+  if (pawnComponent == nullptr) return;
 
-  const auto isStreamedIn = npc.isStreamedInForPlayer(player);
-  if (!isStreamedIn && shouldBeStreamedIn) {
-    npc.streamInForPlayer(player);
-  } else if (isStreamedIn && !shouldBeStreamedIn) {
-    npc.streamOutForPlayer(player);
+  for (auto sideScript : pawnComponent->sideScripts()) {
+    sideScript->Call(publicName, DefaultReturnValue_False, npc.getID(), step, finished);
+  }
+  if (auto mainScript = pawnComponent->mainScript(); mainScript != nullptr) {
+    mainScript->Call(publicName, DefaultReturnValue_False, npc.getID(), step, finished);
   }
 }
 
@@ -247,12 +366,36 @@ bool NpcComponent::isPlayerAfk(const IPlayer &player) const {
 }
 
 INpc *NpcComponent::create(int skin, Vector3 position) {
-  return storage.emplace(skin, position, core->getConfig().getBool("game.use_all_animations"), core->getConfig().getBool("game.validate_animations"));
+  auto npc = storage.emplace(skin, position, core->getConfig().getBool("game.use_all_animations"), core->getConfig().getBool("game.validate_animations"));
+  if (npc != nullptr) {
+    streamer.add(*npc);
+  }
+  return npc;
 }
 
 void NpcComponent::release(int index) {
   if (auto npc = storage.get(index); npc != nullptr) {
+    if (npc->syncQueued) {
+      syncQueue.erase(std::find(syncQueue.begin(), syncQueue.end(), npc));
+    }
+    syncScheduler.remove(*npc);
+    onSyncAuthorityChanged(npc->syncAuthority, nullptr);
+    if (npc->syncAuthorityQueued) {
+      syncAuthorityQueue.erase(std::find(syncAuthorityQueue.begin(), syncAuthorityQueue.end(), npc));
+    }
+    if (npc->stateFlushQueued) {
+      stateFlushQueue.erase(std::find(stateFlushQueue.begin(), stateFlushQueue.end(), npc));
+    }
+    // Corrections are queued from the network receive path, so they may still wait for the tick
+    for (auto it = playersWithSyncBatch.begin(); it != playersWithSyncBatch.end();) {
+      auto &batch = syncBatches[(*it)->getID()];
+      batch.erase(std::remove_if(batch.begin(), batch.end(), [npc](const QueuedSync &sync) {
+        return sync.npc == npc;
+      }), batch.end());
+      it = batch.empty() ? playersWithSyncBatch.erase(it) : it + 1;
+    }
     npc->destream();
+    streamer.remove(*npc);
     storage.release(index, false);
   }
 }
@@ -273,6 +416,310 @@ IEventDispatcher<NpcDamageEventHandler> &NpcComponent::getNpcDamageDispatcher()
   return npcDamageDispatcher;
 }
 
+IEventDispatcher<NpcTaskEventHandler> &NpcComponent::getNpcTaskDispatcher() {
+  return npcTaskDispatcher;
+}
+
+Milliseconds NpcComponent::getSyncCorrectionInterval() const {
+  return syncCorrectionInterval;
+}
+
+void NpcComponent::recordSyncRejection(const IPlayer &player) {
+  ++correctionStats[player.getID()].rejected;
+}
+
+void NpcComponent::recordSyncCorrection(const IPlayer &player) {
+  ++correctionStats[player.getID()].corrections;
+}
+
+const NpcCorrectionStats &NpcComponent::getCorrectionStats(const IPlayer &player) const {
+  return correctionStats[player.getID()];
+}
+
+void NpcComponent::recordMovementValidation(bool valid, Nanoseconds time) {
+  ++validationStats.validated;
+  if (!valid) {
+    ++validationStats.rejected;
+  }
+  validationStats.time += time;
+}
+
+const NpcValidationStats &NpcComponent::getValidationStats() const {
+  return validationStats;
+}
+
+void NpcComponent::recordTaskUpdate(bool suppressed) {
+  if (suppressed) {
+    ++taskUpdateStats.suppressed;
+  } else {
+    ++taskUpdateStats.sent;
+  }
+}
+
+const NpcTaskUpdateStats &NpcComponent::getTaskUpdateStats() const {
+  return taskUpdateStats;
+}
+
+void NpcComponent::recordEncode(bool hit, size_t bytes) {
+  for (auto stats : {&tickEncodeStats, &totalEncodeStats}) {
+    if (hit) {
+      ++stats->hits;
+    } else {
+      ++stats->misses;
+      stats->bytesEncoded += bytes;
+    }
+  }
+}
+
+const NpcEncodeStats &NpcComponent::getLastTickEncodeStats() const {
+  return lastTickEncodeStats;
+}
+
+const NpcEncodeStats &NpcComponent::getTotalEncodeStats() const {
+  return totalEncodeStats;
+}
+
+const NpcOwnershipWeights &NpcComponent::getOwnershipWeights() const {
+  return ownershipWeights;
+}
+
+int NpcComponent::getOwnedNpcsCount(const IPlayer &player) const {
+  return ownedNpcsCount[player.getID()];
+}
+
+int NpcComponent::getPlayerLoad(const IPlayer &player) const {
+  return playersLoad[player.getID()];
+}
+
+void NpcComponent::onSyncAuthorityChanged(const IPlayer *from, const IPlayer *to) {
+  if (from != nullptr) {
+    --ownedNpcsCount[from->getID()];
+  }
+  if (to != nullptr) {
+    ++ownedNpcsCount[to->getID()];
+  }
+}
+
+void NpcComponent::queueSyncAuthorityUpdate(Npc &npc) {
+  syncAuthorityQueue.push_back(&npc);
+}
+
+void NpcComponent::updateSyncAuthorities(TimePoint now) {
+  // Distances and afk states are not events, npcs shared by a few players are looked at once per interval
+  if (now - lastSyncAuthoritySweep >= syncAuthorityInterval) {
+    lastSyncAuthoritySweep = now;
+    for (auto npc : storage) {
+      auto &npc_ = dynamic_cast<Npc&>(*npc);
+      if (npc_.streamedFor_.entries().size() > 1) {
+        npc_.queueSyncAuthorityUpdate();
+      }
+    }
+  }
+
+  // Swapped out, as updates may queue the npc again
+  std::swap(syncAuthorityBatch, syncAuthorityQueue);
+  for (auto npc : syncAuthorityBatch) {
+    npc->updateSyncOwners();
+  }
+  syncAuthorityBatch.clear();
+}
+
+void NpcComponent::queueStateFlush(Npc &npc) {
+  stateFlushQueue.push_back(&npc);
+}
+
+void NpcComponent::flushStateChanges() {
+  // Swapped out, as a flush may change the state of another npc
+  std::swap(stateFlushBatch, stateFlushQueue);
+  for (auto npc : stateFlushBatch) {
+    npc->stateFlushQueued = false;
+    // Held back by beginUpdate(), commitUpdate() sends it
+    npc->flushStateChanges();
+  }
+  stateFlushBatch.clear();
+}
+
+void NpcComponent::scheduleSync(Npc &npc) {
+  syncScheduler.schedule(npc, npc.lastSyncBroadcast + onfootSyncRate);
+}
+
+void NpcComponent::queueSync(Npc &npc) {
+  syncQueue.push_back(&npc);
+}
+
+void NpcComponent::queueSyncPacket(const NpcSyncPacket &packet, Npc &npc, IPlayer &player, float priority) {
+  auto &batch = syncBatches[player.getID()];
+  if (batch.empty()) {
+    playersWithSyncBatch.push_back(&player);
+  }
+  batch.push_back({packet, &npc, priority});
+}
+
+void NpcComponent::flushSyncBatches() {
+  std::sort(syncQueue.begin(), syncQueue.end(), [](Npc *a, Npc *b) {
+    return a->getID() < b->getID();
+  });
+  for (auto npc : syncQueue) {
+    npc->sendSync();
+  }
+  syncQueue.clear();
+
+  const auto now = Time::now();
+  for (auto player : playersWithSyncBatch) {
+    auto &queued = syncBatches[player->getID()];
+
+    // Highest priority first until the budget runs out, the rest waits for one of the next ticks
+    bandwidthBudget.refill(*player, now);
+    std::stable_sort(queued.begin(), queued.end(), [](const QueuedSync &a, const QueuedSync &b) {
+      return a.priority > b.priority;
+    });
+    auto &batch = sentSyncs;
+    batch.clear();
+    size_t deferred = 0;
+    for (const auto &sync : queued) {
+      if (bandwidthBudget.trySpend(*player, sync.packet.getEntrySize())) {
+        sync.npc->onSyncSent(*player, sync.packet, now);
+        batch.push_back(sync.packet);
+      } else {
+        sync.npc->onSyncDeferred(*player, sync.packet);
+        ++deferred;
+      }
+    }
+    queued.clear();
+    if (deferred != 0) {
+      bandwidthBudget.recordDeferred(*player, deferred);
+    }
+
+    if (batch.empty()) {
+      continue;
+    }
+    if (batch.size() == 1) {
+      PacketHelper::send(batch.front(), *player);
+      continue;
+    }
+
+    auto sendRange = [&](size_t first, size_t last) {
+      NpcSyncBatchPacket packet;
+      packet.Entries = Span<const NpcSyncPacket>(batch.data() + first, last - first);
+      PacketHelper::send(packet, *player);
+    };
+
+    // Split into packets fitting kSyncBatchMaxSize
+    size_t first = 0;
+    size_t size = 2; // packet id and entries count
+    for (size_t i = 0; i < batch.size(); ++i) {
+      const auto entrySize = batch[i].getEntrySize();
+      if (i > first && (size + entrySize > kSyncBatchMaxSize || i - first == UINT8_MAX)) {
+        sendRange(first, i);
+        first = i;
+        size = 2;
+      }
+      size += entrySize;
+    }
+    sendRange(first, batch.size());
+  }
+  playersWithSyncBatch.clear();
+}
+
+NpcStreamer &NpcComponent::getStreamer() {
+  return streamer;
+}
+
+NpcBandwidthBudget &NpcComponent::getBandwidthBudget() {
+  return bandwidthBudget;
+}
+
+Milliseconds NpcComponent::getSyncKeyframeInterval() const {
+  return syncKeyframeInterval;
+}
+
+Milliseconds NpcComponent::getSyncAuthorityInterval() const {
+  return syncAuthorityInterval;
+}
+
+Milliseconds NpcComponent::getSyncInterval(float distanceSqr) const {
+  auto rateDivisor = 1;
+  for (const auto &tier : syncLodTiers) {
+    if (distanceSqr >= tier.distanceSqr) {
+      rateDivisor = std::max(rateDivisor, tier.rateDivisor);
+    }
+  }
+  if (rateDivisor == 1) {
+    return Milliseconds(0);
+  }
+  // Syncs are attempted a bit later than every onfootSyncRate, half of a period of slack
+  // keeps a divisor of 2 from turning into 3
+  return onfootSyncRate * rateDivisor - onfootSyncRate / 2;
+}
+
+bool NpcComponent::isSyncQuantized() const {
+  return syncQuantized;
+}
+
+void NpcComponent::queueStreamIn(const Npc &npc, IPlayer &player) {
+  auto &batch = streamBatches[player.getID()];
+  if (batch.streamIn.empty() && batch.streamOut.empty()) {
+    playersWithStreamBatch.push_back(&player);
+  }
+  batch.streamIn.push_back(npc.getID());
+}
+
+void NpcComponent::queueStreamOut(const Npc &npc, IPlayer &player) {
+  auto &batch = streamBatches[player.getID()];
+  if (batch.streamIn.empty() && batch.streamOut.empty()) {
+    playersWithStreamBatch.push_back(&player);
+  }
+  batch.streamOut.push_back(npc.getID());
+}
+
+void NpcComponent::flushStreamBatches() {
+  if (playersWithStreamBatch.empty()) {
+    return;
+  }
+
+  auto sortUnique = [](DynamicArray<uint16_t> &ids) {
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  };
+
+  for (auto player : playersWithStreamBatch) {
+    auto &batch = streamBatches[player->getID()];
+    sortUnique(batch.streamOut);
+    sortUnique(batch.streamIn);
+
+    NpcStreamBatchRpc rpc;
+    auto sendIfFull = [&](bool force) {
+      if ((force && (!rpc.StreamOut.empty() || !rpc.StreamIn.empty()))
+          || rpc.StreamOut.size() + rpc.StreamIn.size() >= kStreamBatchMaxEntries) {
+        PacketHelper::send(rpc, *player);
+        // Reliable, so it's charged even beyond the budget, syncs yield instead
+        bandwidthBudget.charge(*player, rpc.getSize());
+        rpc.StreamOut.clear();
+        rpc.StreamIn.clear();
+      }
+    };
+
+    for (auto npcId : batch.streamOut) {
+      rpc.StreamOut.push_back(npcId);
+      sendIfFull(false);
+    }
+    // Stream in could have been undone in the same tick, or the npc might have been destroyed
+    for (auto npcId : batch.streamIn) {
+      auto npc = storage.get(npcId);
+      if (npc == nullptr || !npc->isStreamedInForPlayer(*player)) {
+        continue;
+      }
+      rpc.StreamIn.emplace_back(npcId, &npc->getStreamInPayload());
+      sendIfFull(false);
+    }
+    sendIfFull(true);
+
+    batch.streamIn.clear();
+    batch.streamOut.clear();
+  }
+  playersWithStreamBatch.clear();
+}
+
 const FlatPtrHashSet<INpc> &NpcComponent::entries() {
   return storage._entries();
 }
@@ -311,13 +758,20 @@ bool NpcComponent::NpcControlRPCHandler::onReceive(IPlayer &peer, NetworkBitStre
   NpcControlRpc rpc;
   if (!rpc.read(bs)) return false;
 
+  if (rpc.Type == NpcControlRpc::NpcControlRpcType_ReportLoad) {
+    NpcComponent::instance().playersLoad[peer.getID()] = std::min<uint8_t>(rpc.ClientLoad, 100);
+    return true;
+  }
+
   auto npc_ = NpcComponent::instance().get(rpc.NpcID);
   if (npc_ == nullptr) return false;
 
   if (!npc_->isStreamedInForPlayer(peer)) return false;
 
   auto &npc = dynamic_cast<Npc&>(*npc_);
-  if (rpc.Type == NpcControlRpc::NpcControlRpcType_TakeDamage) {
+  if (rpc.Type == NpcControlRpc::NpcControlRpcType_SequenceStep) {
+    return npc.onTaskSequenceStepCompleted(peer, rpc.SequenceStep);
+  } else if (rpc.Type == NpcControlRpc::NpcControlRpcType_TakeDamage) {
     IPlayer* dealingPeer = &peer;
     if (npc.invulnerable) return false;
     if (rpc.GiveTakeDamage.Damage < 0.f) return false;
@@ -343,6 +797,7 @@ bool NpcComponent::NpcControlRPCHandler::onReceive(IPlayer &peer, NetworkBitStre
     }
 
     npc.health = std::max(0.f, npc.health - rpc.GiveTakeDamage.Damage);
+    npc.markStateChanged();
 
     if (npc.health <= 0.f) {
       NpcComponent::instance().npcDamageDispatcher.dispatch(
@@ -6,6 +6,9 @@
 #include <Impl/pool_impl.hpp>
 
 #include "Npc.h"
+#include "NpcBandwidthBudget.h"
+#include "NpcStreamer.h"
+#include "NpcSyncScheduler.h"
 
 using namespace Impl;
 
@@ -17,6 +20,46 @@ struct NpcDamageEventHandler {
   virtual void onNpcDeath(INpc& npc, IPlayer* killer, int reason) { }
 };
 
+/// Npc task progress handlers
+struct NpcTaskEventHandler {
+  virtual void onNpcTaskSequenceStep(INpc& npc, int step, bool finished) { }
+};
+
+/// Sync ownership election weights, see Npc::electSyncAuthority()
+struct NpcOwnershipWeights {
+  int maxOwnedPerPlayer = 0; ///< 0 = no cap
+  float ping = 0.f; ///< meters per ms
+  float load = 0.f; ///< meters per reported client load point (0-100)
+  float owned = 0.f; ///< meters per npc already owned
+  float stickiness = 0.f; ///< meters the current owner is ahead by
+};
+
+/// Cached npc payloads reused (hits) and written again (misses)
+struct NpcEncodeStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t bytesEncoded = 0;
+};
+
+/// Rejected syncs of a player and corrections sent back, see Npc::sendCorrection()
+struct NpcCorrectionStats {
+  uint64_t rejected = 0;
+  uint64_t corrections = 0;
+};
+
+/// Active task rpcs sent and the ones skipped as the task was already active, see Npc::setActiveTask()
+struct NpcTaskUpdateStats {
+  uint64_t sent = 0;
+  uint64_t suppressed = 0;
+};
+
+/// Sync movement checks, see Npc::validateMovement()
+struct NpcValidationStats {
+  uint64_t validated = 0;
+  uint64_t rejected = 0;
+  Nanoseconds time = Nanoseconds(0);
+};
+
 class NpcComponent final : public PawnEventHandler,
                            public PlayerUpdateEventHandler,
                            public PoolEventHandler<IPlayer>,
@@ -25,11 +68,15 @@ class NpcComponent final : public PawnEventHandler,
                            public IPoolComponent<INpc>,
                            public CoreEventHandler,
                            public NpcDamageEventHandler,
+                           public NpcTaskEventHandler,
                            public NoCopy {
 public:
   static constexpr auto kNpcPoolSize = 8192;
   static constexpr auto kNpcSyncPacketId = NPC_SYNC_PACKET_ID;
   static constexpr auto kNpcControlRpcId = NPC_CONTROL_RPC_ID;
+  static constexpr auto kNpcSyncBatchPacketId = NPC_SYNC_BATCH_PACKET_ID;
+  static constexpr auto kStreamBatchMaxEntries = 128; // keeps a single batch rpc reasonably sized
+  static constexpr auto kSyncBatchMaxSize = 480; // bytes, unreliable packets should not be split
 
   PROVIDE_UID(0x37098B1B46B4198E);
 
@@ -37,6 +84,7 @@ public:
   StringView componentName() const override;
   SemanticVersion componentVersion() const override;
   void onLoad(ICore *c) override;
+  void provideConfiguration(ILogger &logger, IEarlyConfig &config, bool defaults) override;
   void onInit(IComponentList *components) override;
   void onFree(IComponent *component) override;
   void reset() override;
@@ -66,7 +114,9 @@ public:
   void onPlayerTakeDamageNpc(INpc& npc, IPlayer& to, float amount, unsigned weapon, BodyPart part) override;
   void onNpcDeath(INpc& npc, IPlayer* killer, int reason) override;
 
-  static void updateNpcStateForPlayer(Npc &npc, IPlayer &player, float maxDist);
+  // Inherited from NpcTaskEventHandler
+  void onNpcTaskSequenceStep(INpc& npc, int step, bool finished) override;
+
   bool isPlayerAfk(const IPlayer &player) const;
 
   INpc *create(int skin, Vector3 position);
@@ -79,6 +129,58 @@ public:
 
   // Event dispatcher providers
   IEventDispatcher<NpcDamageEventHandler>& getNpcDamageDispatcher();
+  IEventDispatcher<NpcTaskEventHandler>& getNpcTaskDispatcher();
+
+  NpcStreamer &getStreamer();
+  NpcBandwidthBudget &getBandwidthBudget();
+  Milliseconds getSyncKeyframeInterval() const;
+  /// Distances and afk states change over time, so sync authorities are elected again this often
+  Milliseconds getSyncAuthorityInterval() const;
+  /// Min time between two syncs of an npc sent to a player that far from it
+  Milliseconds getSyncInterval(float distanceSqr) const;
+  bool isSyncQuantized() const;
+
+  /// Stream changes are sent in one batch per player, see flushStreamBatches()
+  void queueStreamIn(const Npc &npc, IPlayer &player);
+  void queueStreamOut(const Npc &npc, IPlayer &player);
+  void flushStreamBatches();
+
+  Milliseconds getSyncCorrectionInterval() const;
+  void recordSyncRejection(const IPlayer &player);
+  void recordSyncCorrection(const IPlayer &player);
+  const NpcCorrectionStats &getCorrectionStats(const IPlayer &player) const;
+
+  void recordMovementValidation(bool valid, Nanoseconds time);
+  const NpcValidationStats &getValidationStats() const;
+
+  void recordTaskUpdate(bool suppressed);
+  const NpcTaskUpdateStats &getTaskUpdateStats() const;
+
+  void recordEncode(bool hit, size_t bytes);
+  const NpcEncodeStats &getLastTickEncodeStats() const;
+  const NpcEncodeStats &getTotalEncodeStats() const;
+
+  const NpcOwnershipWeights &getOwnershipWeights() const;
+  int getOwnedNpcsCount(const IPlayer &player) const;
+  /// Client load reported by the player, 0-100
+  int getPlayerLoad(const IPlayer &player) const;
+  void onSyncAuthorityChanged(const IPlayer *from, const IPlayer *to);
+
+  /// Sync owners of the npc are updated by the tick, see updateSyncAuthorities()
+  void queueSyncAuthorityUpdate(Npc &npc);
+  void updateSyncAuthorities(TimePoint now);
+
+  /// Npc state changes are sent once per tick, see Npc::flushStateChanges()
+  void queueStateFlush(Npc &npc);
+  void flushStateChanges();
+
+  /// Npc will be synced by the first tick after onfoot sync rate since its last sync
+  void scheduleSync(Npc &npc);
+
+  /// Npc syncs are sent in one packet per player, see flushSyncBatches()
+  void queueSync(Npc &npc);
+  void queueSyncPacket(const struct NpcSyncPacket &packet, Npc &npc, IPlayer &player, float priority);
+  void flushSyncBatches();
 protected:
   const FlatPtrHashSet<INpc> &entries() override;
 public:
@@ -98,6 +200,15 @@ public:
   static NpcComponent &instance();
 
 private:
+  /// Sync waiting for the player bandwidth budget, defined along with NpcSyncPacket
+  struct QueuedSync;
+
+  /// Npc ids, the npc is looked up again when the batch is sent
+  struct StreamBatch {
+    DynamicArray<uint16_t> streamIn;
+    DynamicArray<uint16_t> streamOut;
+  };
+
   ICore *core = nullptr;
 
   IPawnComponent *pawnComponent = nullptr;
@@ -105,10 +216,52 @@ private:
   IPlayerPool *players = nullptr;
 
   DefaultEventDispatcher<NpcDamageEventHandler> npcDamageDispatcher;
+  DefaultEventDispatcher<NpcTaskEventHandler> npcTaskDispatcher;
+
+  /// Players farther than distance get every rateDivisor-th sync
+  struct SyncLodTier {
+    float distanceSqr;
+    int rateDivisor;
+  };
 
   StaticArray<TimePoint, PLAYER_POOL_SIZE> lastPlayersUpdateSend;
 
   Milliseconds onfootSyncRate;
+  Milliseconds syncKeyframeInterval;
+  Milliseconds syncAuthorityInterval;
+  bool syncQuantized = false;
+  StaticArray<SyncLodTier, 2> syncLodTiers{}; // nearest first
   StreamConfigHelper streamConfigHelper;
+  NpcStreamer streamer;
+
+  StaticArray<StreamBatch, PLAYER_POOL_SIZE> streamBatches;
+  DynamicArray<IPlayer *> playersWithStreamBatch;
+
+  NpcTaskUpdateStats taskUpdateStats;
+  NpcValidationStats validationStats;
+  Milliseconds syncCorrectionInterval;
+  StaticArray<NpcCorrectionStats, PLAYER_POOL_SIZE> correctionStats;
+  NpcEncodeStats tickEncodeStats;
+  NpcEncodeStats lastTickEncodeStats;
+  NpcEncodeStats totalEncodeStats;
+
+  NpcOwnershipWeights ownershipWeights;
+  StaticArray<int, PLAYER_POOL_SIZE> ownedNpcsCount{};
+  StaticArray<uint8_t, PLAYER_POOL_SIZE> playersLoad{};
+
+  DynamicArray<Npc *> syncAuthorityQueue;
+  DynamicArray<Npc *> syncAuthorityBatch; // kept between ticks to reuse the allocation
+  TimePoint lastSyncAuthoritySweep;
+
+  DynamicArray<Npc *> stateFlushQueue;
+  DynamicArray<Npc *> stateFlushBatch; // kept between ticks to reuse the allocation
+
+  NpcSyncScheduler syncScheduler;
+  DynamicArray<Npc *> dueSyncs; // kept between ticks to reuse the allocation
+  DynamicArray<Npc *> syncQueue;
+  StaticArray<DynamicArray<QueuedSync>, PLAYER_POOL_SIZE> syncBatches;
+  DynamicArray<NpcSyncPacket> sentSyncs; // kept between ticks to reuse the allocation
+  NpcBandwidthBudget bandwidthBudget;
+  DynamicArray<IPlayer *> playersWithSyncBatch;
   MarkedPoolStorage<Npc, INpc, 1, kNpcPoolSize> storage;
 };
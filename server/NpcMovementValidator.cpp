@@ -0,0 +1,57 @@
+#include "NpcMovementValidator.h"
+
+const NpcMovementValidator::Sample &NpcMovementValidator::at(size_t age) const {
+  return samples[(newest + kSamplesCount - age) % kSamplesCount];
+}
+
+bool NpcMovementValidator::validate(const Vector3 &pos, TimePoint now, float maxSpeed) const {
+  if (count == 0) {
+    return true;
+  }
+
+  const auto pos2D = Vector2(pos);
+  auto seconds = [](TimePoint from, TimePoint to) {
+    return std::max(0.f, std::chrono::duration<float>(to - from).count());
+  };
+
+  // Newest sample: speed and acceleration since the previous packet
+  const auto &last = at(0);
+  const auto lastDt = seconds(last.time, now);
+  const auto lastDist = glm::distance(last.pos, pos2D);
+  auto allowedSpeed = maxSpeed;
+  if (count > 1) {
+    const auto &previous = at(1);
+    const auto previousDt = seconds(previous.time, last.time);
+    if (previousDt > 0.f) {
+      const auto previousSpeed = glm::distance(previous.pos, last.pos) / previousDt;
+      allowedSpeed = std::min(maxSpeed, previousSpeed + kMaxAcceleration * lastDt);
+    }
+  }
+  if (lastDist > allowedSpeed * lastDt + kSlack) {
+    return false;
+  }
+
+  // Oldest sample of the window: average speed over up to kWindow
+  const Sample *oldest = nullptr;
+  for (size_t age = 1; age < count; ++age) {
+    if (now - at(age).time > kWindow) {
+      break;
+    }
+    oldest = &at(age);
+  }
+  if (oldest != nullptr && glm::distance(oldest->pos, pos2D) > maxSpeed * seconds(oldest->time, now) + kSlack) {
+    return false;
+  }
+  return true;
+}
+
+void NpcMovementValidator::push(const Vector3 &pos, TimePoint now) {
+  newest = (newest + 1) % kSamplesCount;
+  samples[newest] = {Vector2(pos), now};
+  count = std::min(count + 1, kSamplesCount);
+}
+
+void NpcMovementValidator::reset(const Vector3 &pos, TimePoint now) {
+  count = 0;
+  push(pos, now);
+}
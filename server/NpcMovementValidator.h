@@ -0,0 +1,38 @@
+#pragma once
+
+#include <Server/Components/Pawn/pawn.hpp>
+
+#include <Impl/pool_impl.hpp>
+
+using namespace Impl;
+
+/// Accepted sync positions of an npc over the last seconds
+/// A new position is checked against the newest one and against the whole window,
+/// so jitter between two packets is tolerated while a steady speed hack is not
+/// Only horizontal movement is checked, falls are up to the game
+class NpcMovementValidator {
+public:
+  static constexpr size_t kSamplesCount = 16;
+  static constexpr Milliseconds kWindow = Milliseconds(3000);
+  static constexpr float kSlack = 2.f; // meters, sync timing and client interpolation error
+  static constexpr float kMaxAcceleration = 25.f; // m/s^2
+
+  /// Whether the npc could have got to pos by now, maxSpeed is in m/s
+  bool validate(const Vector3 &pos, TimePoint now, float maxSpeed) const;
+  void push(const Vector3 &pos, TimePoint now);
+  /// Should be called when the npc is placed by the server, the next sync is checked against pos
+  void reset(const Vector3 &pos, TimePoint now);
+
+private:
+  struct Sample {
+    Vector2 pos;
+    TimePoint time;
+  };
+
+  /// 0 = the newest sample
+  const Sample &at(size_t age) const;
+
+  StaticArray<Sample, kSamplesCount> samples;
+  size_t newest = 0;
+  size_t count = 0;
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <NpcSyncQuantization.hpp>
+
 const int INVALID_NPC_ID = 0xFFFF;
 
 struct NpcControlRpc : NetworkPacketBase<NpcComponent::kNpcControlRpcId, NetworkPacketType::RPC, OrderingChannel_SyncRPC> {
@@ -11,13 +13,33 @@ struct NpcControlRpc : NetworkPacketBase<NpcComponent::kNpcControlRpcId, Network
     NpcControlRpcType_TakeDamage,
 
     NpcControlRpcType_SetActiveTask,
+
+    NpcControlRpcType_StreamBatch, ///< many stream outs and ins at once, see NpcStreamBatchRpc
+
+    NpcControlRpcType_SetSyncOwner, ///< player starts or stops uploading the npc sync
+    NpcControlRpcType_ReportLoad, ///< client tells how busy it is, weighs the sync ownership election
+
+    // A single property of a streamed npc has changed, it's updated in place by clients, see Npc::broadcastPropertyUpdate()
+    NpcControlRpcType_SetSkin,
+    NpcControlRpcType_SetWeapon,
+    NpcControlRpcType_SetWeaponAccuracy,
+    NpcControlRpcType_SetWeaponShootingRate,
+    NpcControlRpcType_SetWeaponSkill,
+    NpcControlRpcType_SetStunAnimation,
+    NpcControlRpcType_SetHeading,
+
+    NpcControlRpcType_UpdateState, ///< many of the above and the active task at once, see Npc::flushStateChanges()
+
+    NpcControlRpcType_Revive, ///< dead npc gets its health and task back, the ped is kept
+
+    NpcControlRpcType_SequenceStep, ///< sync owner has completed a step of NpcTaskSequence
   };
 
   NpcControlRpcType Type;
 
   uint16_t NpcID;
 
-  struct {
+  struct StreamInData {
     int Skin;
     Vector3 Position;
     float Heading;
@@ -31,6 +53,36 @@ struct NpcControlRpc : NetworkPacketBase<NpcComponent::kNpcControlRpcId, Network
     NpcWeaponSkillType WeaponSkill;
 
     NpcTasksSet Task;
+
+    static StreamInData fromNpc(const Npc &npc) {
+      StreamInData data;
+      data.Skin = npc.skin;
+      data.Position = npc.pos;
+      data.Heading = npc.angle;
+      data.Health = npc.health;
+      data.StunEnabled = npc.stunAnimationEnabled;
+      data.WeaponID = npc.currentWeaponId;
+      data.WeaponShootingAccuracy = npc.weaponShootingAccuracy;
+      data.WeaponShootingRate = npc.weaponShootingRate;
+      data.WeaponSkill = npc.weaponSkill;
+      data.Task = npc.currentTask;
+      return data;
+    }
+
+    void write(NetworkBitStream& bs) const {
+      bs.writeUINT16(Skin);
+      bs.writeVEC3(Position);
+      bs.writeFLOAT(Heading);
+      bs.writeFLOAT(Health);
+      bs.writeUINT8(StunEnabled ? 1 : 0);
+
+      bs.writeUINT8(WeaponID);
+      bs.writeUINT8(WeaponShootingAccuracy);
+      bs.writeUINT8(WeaponShootingRate);
+      bs.writeUINT8(static_cast<uint8_t>(WeaponSkill));
+
+      std::visit([&bs](const auto &task) { task.writeInternal(bs); }, Task);
+    }
   } StreamIn;
 
   struct {
@@ -40,6 +92,13 @@ struct NpcControlRpc : NetworkPacketBase<NpcComponent::kNpcControlRpcId, Network
     uint16_t DamagerNpcId; ///< id of npc who dealing a damage to this npc
   } GiveTakeDamage;
 
+  uint8_t StateFields = 0; ///< NpcStateField mask of NpcControlRpcType_UpdateState
+  bool SyncOwner = false;
+  uint8_t ClientLoad = 0; ///< 0-100
+  uint8_t SequenceStep = 0;
+
+  const NpcEncodedPayload *EncodedPayload = nullptr; ///< written instead of the type specific data if set, task of UpdateState
+
   bool read(NetworkBitStream& bs) {
     { // Reading a type
       int type_;
@@ -49,6 +108,14 @@ struct NpcControlRpc : NetworkPacketBase<NpcComponent::kNpcControlRpcId, Network
       Type = static_cast<NpcControlRpcType>(type_);
     }
 
+    if (Type == NpcControlRpcType_ReportLoad) {
+      return bs.readUINT8(ClientLoad);
+    }
+
+    if (Type == NpcControlRpcType_SequenceStep) {
+      return bs.readUINT16(NpcID) && bs.readUINT8(SequenceStep);
+    }
+
     if (Type != NpcControlRpcType_GiveDamage && Type != NpcControlRpcType_TakeDamage) return false;
 
     if (!bs.readUINT16(NpcID)) return false;
@@ -67,24 +134,157 @@ struct NpcControlRpc : NetworkPacketBase<NpcComponent::kNpcControlRpcId, Network
     bs.writeUINT8(int(Type));
     bs.writeUINT16(NpcID);
 
-    if (Type == NpcControlRpcType_StreamIn) {
-      bs.writeUINT16(StreamIn.Skin);
-      bs.writeVEC3(StreamIn.Position);
-      bs.writeFLOAT(StreamIn.Heading);
+    if (Type == NpcControlRpcType_UpdateState) {
+      bs.writeUINT8(StateFields);
+      for (auto i = 0; i < NpcStateField_PropertyCount; ++i) {
+        if (StateFields & (1 << i)) {
+          writeProperty(bs, static_cast<NpcControlRpcType>(NpcControlRpcType_SetSkin + i));
+        }
+      }
+      if (StateFields & NpcStateField_Task) {
+        if (EncodedPayload != nullptr) {
+          EncodedPayload->write(bs);
+        } else {
+          std::visit([&bs](const auto &task) { task.writeInternal(bs); }, StreamIn.Task);
+        }
+      }
+    } else if (Type == NpcControlRpcType_Revive) {
       bs.writeFLOAT(StreamIn.Health);
-      bs.writeUINT8(StreamIn.StunEnabled ? 1 : 0);
+      if (EncodedPayload != nullptr) {
+        EncodedPayload->write(bs);
+      } else {
+        std::visit([&bs](const auto &task) { task.writeInternal(bs); }, StreamIn.Task);
+      }
+    } else if (EncodedPayload != nullptr) {
+      EncodedPayload->write(bs);
+    } else if (Type == NpcControlRpcType_StreamIn) {
+      StreamIn.write(bs);
+    } else if (Type == NpcControlRpcType_StreamOut) {
+      // Nothing to do
+    } else if (Type == NpcControlRpcType_SetActiveTask) {
+      std::visit([&bs](const auto &task) { task.writeInternal(bs); }, StreamIn.Task);
+    } else if (Type == NpcControlRpcType_SetSyncOwner) {
+      bs.writeUINT8(SyncOwner ? 1 : 0);
+    } else {
+      writeProperty(bs, Type);
+    }
+  }
 
+  void writeProperty(NetworkBitStream& bs, NpcControlRpcType type) const {
+    if (type == NpcControlRpcType_SetSkin) {
+      bs.writeUINT16(StreamIn.Skin);
+    } else if (type == NpcControlRpcType_SetWeapon) {
       bs.writeUINT8(StreamIn.WeaponID);
+    } else if (type == NpcControlRpcType_SetWeaponAccuracy) {
       bs.writeUINT8(StreamIn.WeaponShootingAccuracy);
+    } else if (type == NpcControlRpcType_SetWeaponShootingRate) {
       bs.writeUINT8(StreamIn.WeaponShootingRate);
+    } else if (type == NpcControlRpcType_SetWeaponSkill) {
       bs.writeUINT8(static_cast<uint8_t>(StreamIn.WeaponSkill));
+    } else if (type == NpcControlRpcType_SetStunAnimation) {
+      bs.writeUINT8(StreamIn.StunEnabled ? 1 : 0);
+    } else if (type == NpcControlRpcType_SetHeading) {
+      bs.writeFLOAT(StreamIn.Heading);
+    }
+  }
 
-      std::visit([&bs](const auto &task) { task.writeInternal(bs); }, StreamIn.Task);
-    } else if (Type == NpcControlRpcType_StreamOut) {
-      // Nothing to do
-    } else if (Type == NpcControlRpcType_SetActiveTask) {
-      std::visit([&bs](const auto &task) { task.writeInternal(bs); }, StreamIn.Task);
+  /// Bytes write() takes for the property update types
+  size_t getPropertyUpdateSize() const {
+    return sizeof(uint8_t) + sizeof(uint16_t) + getPropertySize(Type);
+  }
+
+  /// Bytes write() takes for NpcControlRpcType_UpdateState
+  size_t getUpdateStateSize() const {
+    auto size = sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint8_t);
+    for (auto i = 0; i < NpcStateField_PropertyCount; ++i) {
+      if (StateFields & (1 << i)) {
+        size += getPropertySize(static_cast<NpcControlRpcType>(NpcControlRpcType_SetSkin + i));
+      }
     }
+    if ((StateFields & NpcStateField_Task) && EncodedPayload != nullptr) {
+      size += EncodedPayload->data.size();
+    }
+    return size;
+  }
+
+  static size_t getPropertySize(NpcControlRpcType type) {
+    if (type == NpcControlRpcType_SetSkin) {
+      return sizeof(uint16_t);
+    } else if (type == NpcControlRpcType_SetHeading) {
+      return sizeof(float);
+    }
+    return sizeof(uint8_t);
+  }
+};
+
+/// Stream outs go first, so a restreamed npc is recreated by the client
+struct NpcStreamBatchRpc : NetworkPacketBase<NpcComponent::kNpcControlRpcId, NetworkPacketType::RPC, OrderingChannel_SyncRPC> {
+  DynamicArray<uint16_t> StreamOut;
+  DynamicArray<Pair<uint16_t, const NpcEncodedPayload *>> StreamIn; ///< see Npc::getStreamInPayload()
+
+  void write(NetworkBitStream& bs) const {
+    bs.writeUINT8(int(NpcControlRpc::NpcControlRpcType_StreamBatch));
+
+    bs.writeUINT16(static_cast<uint16_t>(StreamOut.size()));
+    for (auto npcId : StreamOut) {
+      bs.writeUINT16(npcId);
+    }
+
+    bs.writeUINT16(static_cast<uint16_t>(StreamIn.size()));
+    for (const auto &[npcId, payload] : StreamIn) {
+      bs.writeUINT16(npcId);
+      payload->write(bs);
+    }
+  }
+
+  /// Bytes write() takes
+  size_t getSize() const {
+    auto size = sizeof(uint8_t) + sizeof(uint16_t) * 2 + sizeof(uint16_t) * StreamOut.size();
+    for (const auto &[npcId, payload] : StreamIn) {
+      size += sizeof(uint16_t) + payload->data.size();
+    }
+    return size;
+  }
+};
+
+/// Fixed point sync encoding, saves 5 bytes per position and heading, see NpcSyncQuantization for the format
+struct NpcSyncQuantizer {
+  static void writePosition(NetworkBitStream& bs, Vector3 position) {
+    for (auto axis : {position.x, position.y, position.z}) {
+      const auto value = NpcSyncQuantization::quantizeAxis(axis);
+      bs.writeINT8(NpcSyncQuantization::axisCell(value));
+      bs.writeUINT16(NpcSyncQuantization::axisOffset(value));
+    }
+  }
+
+  static bool readPosition(NetworkBitStream& bs, Vector3& position) {
+    for (auto axis : {&position.x, &position.y, &position.z}) {
+      int8_t cell;
+      uint16_t offset;
+      if (!bs.readINT8(cell) || !bs.readUINT16(offset)) return false;
+      *axis = NpcSyncQuantization::dequantizeAxis(NpcSyncQuantization::joinAxis(cell, offset));
+    }
+    return true;
+  }
+
+  static void writeHeading(NetworkBitStream& bs, float heading) {
+    bs.writeUINT16(NpcSyncQuantization::quantizeHeading(heading));
+  }
+
+  static bool readHeading(NetworkBitStream& bs, float& heading) {
+    uint16_t value;
+    if (!bs.readUINT16(value)) return false;
+    heading = NpcSyncQuantization::dequantizeHeading(value);
+    return true;
+  }
+
+  static bool readVelocity(NetworkBitStream& bs, Vector3& velocity) {
+    for (auto axis : {&velocity.x, &velocity.y, &velocity.z}) {
+      uint16_t value;
+      if (!bs.readUINT16(value)) return false;
+      *axis = NpcSyncQuantization::dequantizeVelocity(static_cast<int16_t>(value));
+    }
+    return true;
   }
 };
 
@@ -93,28 +293,85 @@ struct NpcSyncPacket : NetworkPacketBase<NpcComponent::kNpcSyncPacketId, Network
 
   Vector3 Position;
   float Heading;
+  Vector3 Velocity = Vector3(0.f); ///< m/s, uploaded by clients only
 
   float Health;
 
   int VehicleId;
   int VehicleSeatIndex;
 
+  uint8_t Fields = NpcSyncField_All; ///< NpcSyncField mask of written fields
+  const NpcEncodedPayload *EncodedEntry = nullptr; ///< written by writeEntry() instead of the fields if set
+
   bool read(NetworkBitStream& bs) {
     if (!bs.readUINT16(NpcID)) return false;
-    if (!bs.readPosVEC3(Position)) return false;
-    if (!bs.readFLOAT(Heading)) return false;
+    // Clients upload position, heading and optionally velocity, the flags tell how they're encoded
+    if (!bs.readUINT8(Fields)) return false;
+    if (Fields & NpcSyncField_Quantized) {
+      if (!NpcSyncQuantizer::readPosition(bs, Position)) return false;
+      if (!NpcSyncQuantizer::readHeading(bs, Heading)) return false;
+      if ((Fields & NpcSyncField_Velocity) && !NpcSyncQuantizer::readVelocity(bs, Velocity)) return false;
+    } else {
+      if (!bs.readPosVEC3(Position)) return false;
+      if (!bs.readFLOAT(Heading)) return false;
+      if ((Fields & NpcSyncField_Velocity) && !bs.readVEC3(Velocity)) return false;
+    }
     if (!(Heading >= 0.f && Heading <= 360.f)) return false;
+    for (auto axis : {Velocity.x, Velocity.y, Velocity.z}) {
+      if (!(axis >= -128.f && axis <= 128.f)) return false; // NaN fails as well
+    }
 
     return true;
   }
 
   void write(NetworkBitStream& bs) const {
     bs.writeUINT8(PacketID);
+    writeEntry(bs);
+  }
+
+  /// Sync without the packet id, as it's written into NpcSyncBatchPacket
+  void writeEntry(NetworkBitStream& bs) const {
+    if (EncodedEntry != nullptr) {
+      EncodedEntry->write(bs);
+      return;
+    }
     bs.writeUINT16(NpcID);
-    bs.writeVEC3(Position);
-    bs.writeFLOAT(Heading);
-    bs.writeFLOAT(Health);
-    bs.writeUINT16(VehicleId);
-    bs.writeINT8(VehicleSeatIndex);
+    bs.writeUINT8(Fields);
+    if (Fields & NpcSyncField_Quantized) {
+      if (Fields & NpcSyncField_Position) NpcSyncQuantizer::writePosition(bs, Position);
+      if (Fields & NpcSyncField_Heading) NpcSyncQuantizer::writeHeading(bs, Heading);
+    } else {
+      if (Fields & NpcSyncField_Position) bs.writeVEC3(Position);
+      if (Fields & NpcSyncField_Heading) bs.writeFLOAT(Heading);
+    }
+    if (Fields & NpcSyncField_Health) bs.writeFLOAT(Health);
+    if (Fields & NpcSyncField_Vehicle) {
+      bs.writeUINT16(VehicleId);
+      bs.writeINT8(VehicleSeatIndex);
+    }
+  }
+
+  /// Bytes writeEntry() takes
+  size_t getEntrySize() const {
+    const auto quantized = (Fields & NpcSyncField_Quantized) != 0;
+    size_t size = sizeof(uint16_t) + sizeof(uint8_t);
+    if (Fields & NpcSyncField_Position) size += quantized ? 9 : 12;
+    if (Fields & NpcSyncField_Heading) size += quantized ? 2 : 4;
+    if (Fields & NpcSyncField_Health) size += 4;
+    if (Fields & NpcSyncField_Vehicle) size += 3;
+    return size;
+  }
+};
+
+/// Syncs of many npcs sent to a player at once
+struct NpcSyncBatchPacket : NetworkPacketBase<NpcComponent::kNpcSyncBatchPacketId, NetworkPacketType::Packet, OrderingChannel_SyncPacket> {
+  Span<const NpcSyncPacket> Entries;
+
+  void write(NetworkBitStream& bs) const {
+    bs.writeUINT8(PacketID);
+    bs.writeUINT8(static_cast<uint8_t>(Entries.size()));
+    for (const auto &entry : Entries) {
+      entry.writeEntry(bs);
+    }
   }
 };
@@ -0,0 +1,625 @@
+#include "NpcStreamer.h"
+#include "Npc.h"
+
+uint64_t NpcStreamer::cellKey(int world, int x, int y) {
+  return (static_cast<uint64_t>(static_cast<uint32_t>(world)) << 32)
+      | (static_cast<uint64_t>(static_cast<uint16_t>(x)) << 16)
+      | static_cast<uint64_t>(static_cast<uint16_t>(y));
+}
+
+int NpcStreamer::cellCoord(float value) {
+  // int16 range is way more than enough for the map, clamp to keep cell keys unique
+  return std::clamp(static_cast<int>(std::floor(value / kCellSize)), -32768, 32767);
+}
+
+float NpcStreamer::getStreamInRadiusSqr(const Npc &npc) const {
+  const auto radius = npc.streamRadius > 0.f ? npc.streamRadius : streamInRadius;
+  return radius * radius;
+}
+
+float NpcStreamer::getStreamOutRadiusSqr(const Npc &npc) const {
+  if (npc.streamRadius <= 0.f) {
+    return streamOutRadius * streamOutRadius;
+  }
+  const auto radius = npc.streamRadius * (streamOutRadius / streamInRadius);
+  return radius * radius;
+}
+
+const Vector3 &NpcStreamer::getGridPosition(const Npc &npc) const {
+  // Grid positions are the snapshot passes work with, vehicle ones are refreshed at the start of a tick
+  return cells.find(npc.gridCell)->second.entries[npc.gridSlot].pos;
+}
+
+template <typename Fn>
+void NpcStreamer::forEachCellAround(int world, const Vector3 &pos, Fn &&fn) const {
+  // Out radius covers the in one, far npcs are not looked up there
+  const auto range = static_cast<int>(std::ceil(streamOutRadius / kCellSize));
+  const auto cellX = cellCoord(pos.x);
+  const auto cellY = cellCoord(pos.y);
+  for (auto x = cellX - range; x <= cellX + range; ++x) {
+    for (auto y = cellY - range; y <= cellY + range; ++y) {
+      if (const auto it = cells.find(cellKey(world, x, y)); it != cells.end()) {
+        fn(it->second);
+      }
+    }
+  }
+}
+
+void NpcStreamer::add(Npc &npc) {
+  const auto pos = npc.getPosition();
+  const auto key = cellKey(npc.getVirtualWorld(), cellCoord(pos.x), cellCoord(pos.y));
+
+  auto &cell = cells[key];
+  npc.gridCell = key;
+  npc.gridCellZ = cellCoord(pos.z);
+  npc.gridSlot = static_cast<int>(cell.entries.size());
+  npc.gridEpoch = ++epoch;
+  cell.entries.push_back({&npc, pos});
+  cell.epoch = epoch;
+
+  if (npc.getVehicle() != nullptr || npc.isExtrapolating()) {
+    movingNpcs.insert(&npc);
+  } else {
+    movingNpcs.erase(&npc);
+  }
+}
+
+void NpcStreamer::remove(Npc &npc) {
+  detach(npc);
+  movingNpcs.erase(&npc);
+  farNpcs.erase(&npc);
+  npc.gridFar = false;
+
+  for (auto player : npc.streamedFor_.entries()) {
+    streamedNpcs[player->getID()].erase(&npc);
+  }
+  for (auto player : playersWithStreamInQueue) {
+    streamInQueues[player->getID()].erase(&npc);
+  }
+}
+
+void NpcStreamer::update(Npc &npc) {
+  const auto pos = npc.getPosition();
+  const auto key = cellKey(npc.getVirtualWorld(), cellCoord(pos.x), cellCoord(pos.y));
+
+  if (npc.gridSlot == -1 || npc.gridCell != key) {
+    // Do not touch streamed sets, the npc is only moving to another cell
+    detach(npc);
+    add(npc);
+    return;
+  }
+
+  if (auto it = cells.find(key); it != cells.end()) {
+    auto &cell = it->second;
+    cell.entries[npc.gridSlot].pos = pos;
+    if (const auto cellZ = cellCoord(pos.z); cellZ != npc.gridCellZ) {
+      npc.gridCellZ = cellZ;
+      npc.gridEpoch = ++epoch;
+      cell.epoch = epoch;
+    }
+  }
+  if (npc.getVehicle() != nullptr || npc.isExtrapolating()) {
+    movingNpcs.insert(&npc);
+  } else {
+    movingNpcs.erase(&npc);
+  }
+}
+
+void NpcStreamer::detach(Npc &npc) {
+  if (npc.gridSlot == -1) {
+    return;
+  }
+
+  if (auto it = cells.find(npc.gridCell); it != cells.end()) {
+    auto &cell = it->second;
+    // swap & pop, the moved entry has to know its new slot
+    cell.entries[npc.gridSlot] = cell.entries.back();
+    cell.entries[npc.gridSlot].npc->gridSlot = npc.gridSlot;
+    cell.entries.pop_back();
+    // Empty cells are kept, players have to see the epoch change of the cell the npc has left
+    cell.epoch = ++epoch;
+  }
+
+  npc.gridSlot = -1;
+  npc.gridEpoch = ++epoch;
+}
+
+void NpcStreamer::updateMovingNpcs() {
+  if (movingNpcs.empty()) {
+    return;
+  }
+  DynamicArray<Npc *> npcs(movingNpcs.begin(), movingNpcs.end());
+  for (auto npc : npcs) {
+    update(*npc);
+  }
+}
+
+void NpcStreamer::clear() {
+  cells.clear();
+  movingNpcs.clear();
+  farNpcs.clear();
+  pendingPlayers.clear();
+  passRequested.fill(false);
+  for (auto player : playersWithStreamInQueue) {
+    streamInQueues[player->getID()].clear();
+  }
+  playersWithStreamInQueue.clear();
+  streamInQueueListed.fill(false);
+  for (auto &streamed : streamedNpcs) {
+    streamed.clear();
+  }
+  invalidatePlayers();
+}
+
+void NpcStreamer::invalidatePlayers() {
+  for (auto &state : playerStates) {
+    state.valid = false;
+  }
+}
+
+void NpcStreamer::requestPass(IPlayer &player) {
+  const auto playerId = player.getID();
+  if (!passRequested[playerId]) {
+    passRequested[playerId] = true;
+    pendingPlayers.push_back(&player);
+  }
+}
+
+void NpcStreamer::processPasses(TimePoint now) {
+  if (pendingPlayers.empty()) {
+    return;
+  }
+
+  // Player id order keeps the applied sends the same whatever the threads count is
+  std::sort(pendingPlayers.begin(), pendingPlayers.end(), [](IPlayer *a, IPlayer *b) {
+    return a->getID() < b->getID();
+  });
+
+  passes.resize(pendingPlayers.size());
+  for (size_t i = 0; i < pendingPlayers.size(); ++i) {
+    auto &pass = passes[i];
+    auto &player = *pendingPlayers[i];
+    pass.player = &player;
+    pass.pos = player.getPosition();
+    pass.world = player.getVirtualWorld();
+    pass.active = player.getState() != PlayerState_None;
+    passRequested[player.getID()] = false;
+  }
+  pendingPlayers.clear();
+
+  workers.parallelFor(passes.size(), [this, now](size_t i) {
+    computePass(passes[i], now);
+  });
+
+  if (verificationLogger != nullptr && workers.size() > 0) {
+    verifyPasses(now);
+  }
+
+  for (auto &pass : passes) {
+    applyPass(pass);
+  }
+}
+
+void NpcStreamer::computePass(StreamPass &pass, TimePoint now) const {
+  const auto &player = *pass.player;
+  const auto playerId = player.getID();
+  const auto &streamed = streamedNpcs[playerId];
+  const auto &prevState = playerStates[playerId];
+  auto &state = pass.state;
+  auto &stats = pass.stats;
+
+  state = prevState;
+  stats = NpcStreamStats();
+  pass.streamIn.clear();
+  pass.streamOut.clear();
+  pass.budgetSelected = false;
+
+  const auto &playerPos = pass.pos;
+  const auto playerWorld = pass.world;
+  const auto isPlayerActive = pass.active;
+  const auto playerCellX = cellCoord(playerPos.x);
+  const auto playerCellY = cellCoord(playerPos.y);
+  const auto playerCellZ = cellCoord(playerPos.z);
+
+  // Everything has to be evaluated again if we changed our cell
+  const auto playerMoved = !prevState.valid
+      || prevState.active != isPlayerActive
+      || prevState.world != playerWorld
+      || prevState.cellX != playerCellX
+      || prevState.cellY != playerCellY
+      || prevState.cellZ != playerCellZ;
+
+  // Npcs kept by min residency have to be checked again until they go
+  const auto recheckStreamed = playerMoved || prevState.residencyPending;
+
+  auto distanceSqrTo = [&](const Vector3 &pos) {
+    const auto dist3D = pos - playerPos;
+    return glm::dot(dist3D, dist3D);
+  };
+
+  auto &streamIn = pass.streamIn;
+  auto anyCellChanged = recheckStreamed;
+  if (isPlayerActive) {
+    forEachCellAround(playerWorld, playerPos, [&](const Cell &cell) {
+      if (!playerMoved && cell.epoch <= prevState.epoch) {
+        stats.skipped += cell.entries.size();
+        return;
+      }
+      anyCellChanged = true;
+      for (const auto &entry : cell.entries) {
+        if (entry.npc->gridFar || entry.npc->isStreamedInForPlayer(player)) {
+          continue; // far and streamed ones are checked below
+        }
+        if (!playerMoved && entry.npc->gridEpoch <= prevState.epoch) {
+          ++stats.skipped;
+          continue;
+        }
+        ++stats.evaluated;
+        if (distanceSqrTo(entry.pos) < getStreamInRadiusSqr(*entry.npc)) {
+          streamIn.push_back(entry.npc);
+        }
+      }
+    });
+
+    // Npcs with a large stream radius may sit beyond the cells around us
+    // Streamed ones may move far away from our cells, so they're only marked for the sweep below
+    for (auto npc : farNpcs) {
+      if (!playerMoved && npc->gridEpoch <= prevState.epoch) {
+        ++stats.skipped;
+        continue;
+      }
+      if (npc->isStreamedInForPlayer(player)) {
+        anyCellChanged = true;
+        continue;
+      }
+      if (npc->getVirtualWorld() != playerWorld) {
+        continue;
+      }
+      anyCellChanged = true;
+      ++stats.evaluated;
+      if (distanceSqrTo(getGridPosition(*npc)) < getStreamInRadiusSqr(*npc)) {
+        streamIn.push_back(npc);
+      }
+    }
+  }
+
+  // Npcs leaving our cells always touch a cell around us, so the streamed set is left alone if nothing changed
+  auto &streamOut = pass.streamOut;
+  state.residencyPending = false;
+  if (anyCellChanged) {
+    for (const auto &[npc, streamedAt] : streamed) {
+      if (!recheckStreamed && npc->gridEpoch <= prevState.epoch) {
+        ++stats.skipped;
+        continue;
+      }
+      ++stats.evaluated;
+      if (!isPlayerActive || npc->getVirtualWorld() != playerWorld) {
+        streamOut.push_back(npc);
+      } else if (distanceSqrTo(getGridPosition(*npc)) >= getStreamOutRadiusSqr(*npc)) {
+        if (now - streamedAt >= minResidency) {
+          streamOut.push_back(npc);
+        } else {
+          state.residencyPending = true;
+        }
+      }
+    }
+  } else {
+    stats.skipped += streamed.size();
+  }
+
+  // Going over the budget (or having been over it) needs every candidate around to pick the best ones
+  if (isPlayerActive && maxStreamedPerPlayer > 0 && anyCellChanged) {
+    const auto projectedCount = streamed.size() - streamOut.size() + streamIn.size();
+    if (state.saturated || projectedCount > maxStreamedPerPlayer) {
+      streamIn.clear();
+      streamOut.clear();
+      state.saturated = selectBestNpcs(pass, now);
+      pass.budgetSelected = true;
+    }
+  } else if (!isPlayerActive || maxStreamedPerPlayer == 0) {
+    state.saturated = false;
+  }
+
+  // Hash set order depends on addresses, ids do not
+  auto byId = [](Npc *a, Npc *b) {
+    return a->getID() < b->getID();
+  };
+  std::sort(streamIn.begin(), streamIn.end(), byId);
+  std::sort(streamOut.begin(), streamOut.end(), byId);
+
+  state.valid = true;
+  state.active = isPlayerActive;
+  state.world = playerWorld;
+  state.cellX = playerCellX;
+  state.cellY = playerCellY;
+  state.cellZ = playerCellZ;
+  state.epoch = epoch;
+}
+
+void NpcStreamer::applyPass(StreamPass &pass) {
+  auto &player = *pass.player;
+  const auto playerId = player.getID();
+  playerStates[playerId] = pass.state;
+  lastPassStats[playerId] = pass.stats;
+  totalStats.evaluated += pass.stats.evaluated;
+  totalStats.skipped += pass.stats.skipped;
+
+  for (auto npc : pass.streamOut) {
+    npc->streamOutForPlayer(player);
+  }
+
+  if (streamInsPerTick == 0) {
+    for (auto npc : pass.streamIn) {
+      npc->streamInForPlayer(player);
+    }
+    return;
+  }
+
+  auto &queue = streamInQueues[playerId];
+  if (pass.budgetSelected) {
+    queue.clear(); // npcs which were not selected again lost their place
+  }
+  if (!streamInQueueListed[playerId] && !pass.streamIn.empty()) {
+    streamInQueueListed[playerId] = true;
+    playersWithStreamInQueue.push_back(&player);
+  }
+  queue.insert(pass.streamIn.begin(), pass.streamIn.end());
+}
+
+void NpcStreamer::drainStreamInQueues() {
+  struct Candidate {
+    int priority;
+    float distSqr;
+    Npc *npc;
+  };
+
+  // Same order as the budget uses, so the npcs kept by it come first
+  auto isBetter = [](const Candidate &a, const Candidate &b) {
+    if (a.priority != b.priority) return a.priority > b.priority;
+    if (a.distSqr != b.distSqr) return a.distSqr < b.distSqr;
+    return a.npc->getID() < b.npc->getID();
+  };
+
+  DynamicArray<Candidate> candidates;
+  for (auto it = playersWithStreamInQueue.begin(); it != playersWithStreamInQueue.end();) {
+    auto &player = **it;
+    auto &queue = streamInQueues[player.getID()];
+
+    const auto playerPos = player.getPosition();
+    const auto playerWorld = player.getVirtualWorld();
+    const auto isPlayerActive = player.getState() != PlayerState_None;
+
+    // Npcs could have left while waiting, they're dropped the same way streamed ones go out
+    candidates.clear();
+    for (auto npc : queue) {
+      if (!isPlayerActive || npc->getVirtualWorld() != playerWorld || npc->isStreamedInForPlayer(player)) {
+        continue;
+      }
+      const auto dist3D = getGridPosition(*npc) - playerPos;
+      const auto distSqr = glm::dot(dist3D, dist3D);
+      if (distSqr < getStreamOutRadiusSqr(*npc)) {
+        candidates.push_back({npc->streamPriority, distSqr, npc});
+      }
+    }
+
+    auto count = std::min(candidates.size(), streamInsPerTick);
+    if (maxStreamedPerPlayer > 0) {
+      const auto streamedCount = streamedNpcs[player.getID()].size();
+      count = std::min(count, streamedCount < maxStreamedPerPlayer ? maxStreamedPerPlayer - streamedCount : 0);
+    }
+    std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(), isBetter);
+
+    queue.clear();
+    for (size_t i = count; i < candidates.size(); ++i) {
+      queue.insert(candidates[i].npc);
+    }
+    for (size_t i = 0; i < count; ++i) {
+      candidates[i].npc->streamInForPlayer(player);
+    }
+
+    if (queue.empty()) {
+      streamInQueueListed[player.getID()] = false;
+      it = playersWithStreamInQueue.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void NpcStreamer::verifyPasses(TimePoint now) const {
+  StreamPass serial;
+  for (const auto &pass : passes) {
+    serial.player = pass.player;
+    serial.pos = pass.pos;
+    serial.world = pass.world;
+    serial.active = pass.active;
+    computePass(serial, now);
+
+    if (serial.streamIn != pass.streamIn
+        || serial.streamOut != pass.streamOut
+        || serial.state.saturated != pass.state.saturated
+        || serial.state.residencyPending != pass.state.residencyPending) {
+      verificationLogger->logLn(LogLevel::Error,
+                                "npcs: parallel streaming pass for player %d differs from the serial one",
+                                pass.player->getID());
+    }
+  }
+}
+
+bool NpcStreamer::selectBestNpcs(StreamPass &pass, TimePoint now) const {
+  struct Candidate {
+    int priority;
+    float distSqr;
+    Npc *npc;
+  };
+
+  // Higher priority first, then the nearest one, then the lowest id to stay deterministic
+  auto isBetter = [](const Candidate &a, const Candidate &b) {
+    if (a.priority != b.priority) return a.priority > b.priority;
+    if (a.distSqr != b.distSqr) return a.distSqr < b.distSqr;
+    return a.npc->getID() < b.npc->getID();
+  };
+
+  const auto &player = *pass.player;
+  const auto &playerPos = pass.pos;
+  const auto playerWorld = pass.world;
+
+  // Bounded heap with the worst of the best K on top, O(n log K)
+  DynamicArray<Candidate> best;
+  best.reserve(maxStreamedPerPlayer);
+  size_t inRange = 0;
+
+  auto consider = [&](Npc *npc, const Vector3 &pos) {
+    ++pass.stats.evaluated;
+    const auto dist3D = pos - playerPos;
+    const auto distSqr = glm::dot(dist3D, dist3D);
+    // Streamed npcs stay candidates up to the out radius, so the budget does not flap on the edge either
+    const auto isStreamed = npc->isStreamedInForPlayer(player);
+    if (distSqr >= (isStreamed ? getStreamOutRadiusSqr(*npc) : getStreamInRadiusSqr(*npc))) {
+      return;
+    }
+    ++inRange;
+    const Candidate candidate{npc->streamPriority, distSqr, npc};
+    if (best.size() < maxStreamedPerPlayer) {
+      best.push_back(candidate);
+      std::push_heap(best.begin(), best.end(), isBetter);
+    } else if (isBetter(candidate, best.front())) {
+      std::pop_heap(best.begin(), best.end(), isBetter);
+      best.back() = candidate;
+      std::push_heap(best.begin(), best.end(), isBetter);
+    }
+  };
+
+  forEachCellAround(playerWorld, playerPos, [&](const Cell &cell) {
+    for (const auto &entry : cell.entries) {
+      if (!entry.npc->gridFar) {
+        consider(entry.npc, entry.pos);
+      }
+    }
+  });
+  for (auto npc : farNpcs) {
+    if (npc->getVirtualWorld() == playerWorld) {
+      consider(npc, getGridPosition(*npc));
+    }
+  }
+
+  FlatPtrHashSet<Npc> selected;
+  selected.reserve(best.size());
+  for (const auto &candidate : best) {
+    selected.insert(candidate.npc);
+    if (!candidate.npc->isStreamedInForPlayer(player)) {
+      pass.streamIn.push_back(candidate.npc);
+    }
+  }
+
+  // The budget is a hard cap, min residency only delays going out of range
+  for (const auto &[npc, streamedAt] : streamedNpcs[player.getID()]) {
+    if (selected.find(npc) != selected.end()) {
+      continue;
+    }
+    const auto dist3D = getGridPosition(*npc) - playerPos;
+    if (npc->getVirtualWorld() == playerWorld
+        && glm::dot(dist3D, dist3D) >= getStreamOutRadiusSqr(*npc)
+        && now - streamedAt < minResidency) {
+      pass.state.residencyPending = true;
+      continue;
+    }
+    pass.streamOut.push_back(npc);
+  }
+
+  return inRange > maxStreamedPerPlayer;
+}
+
+void NpcStreamer::setMaxStreamedPerPlayer(size_t max) {
+  maxStreamedPerPlayer = max;
+  invalidatePlayers();
+}
+
+void NpcStreamer::setStreamRadii(float inRadius, float outRadius) {
+  streamInRadius = std::max(inRadius, 1.f);
+  streamOutRadius = std::max(outRadius, streamInRadius);
+
+  for (auto &[key, cell] : cells) {
+    for (const auto &entry : cell.entries) {
+      updateStreamRadius(*entry.npc);
+    }
+  }
+  invalidatePlayers();
+}
+
+void NpcStreamer::setMinResidency(Milliseconds residency) {
+  minResidency = std::max(residency, Milliseconds(0));
+}
+
+void NpcStreamer::touch(Npc &npc) {
+  if (npc.gridSlot == -1) {
+    return;
+  }
+  npc.gridEpoch = ++epoch;
+  if (auto it = cells.find(npc.gridCell); it != cells.end()) {
+    it->second.epoch = epoch;
+  }
+}
+
+void NpcStreamer::updateStreamRadius(Npc &npc) {
+  npc.gridFar = getStreamOutRadiusSqr(npc) > streamOutRadius * streamOutRadius;
+  if (npc.gridFar) {
+    farNpcs.insert(&npc);
+  } else {
+    farNpcs.erase(&npc);
+  }
+  touch(npc);
+
+  // The npc may be streamed far from the cells these players look at
+  for (auto player : npc.streamedFor_.entries()) {
+    playerStates[player->getID()].valid = false;
+  }
+}
+
+void NpcStreamer::setStreamInsPerTick(size_t count) {
+  streamInsPerTick = count;
+}
+
+void NpcStreamer::setThreads(size_t count) {
+  workers.start(count);
+}
+
+void NpcStreamer::setParallelVerification(ILogger *logger) {
+  verificationLogger = logger;
+}
+
+void NpcStreamer::removePlayer(const IPlayer &player) {
+  const auto playerId = player.getID();
+  if (passRequested[playerId]) {
+    passRequested[playerId] = false;
+    pendingPlayers.erase(std::find(pendingPlayers.begin(), pendingPlayers.end(), &player));
+  }
+  streamInQueues[playerId].clear();
+  if (streamInQueueListed[playerId]) {
+    streamInQueueListed[playerId] = false;
+    playersWithStreamInQueue.erase(std::find(playersWithStreamInQueue.begin(), playersWithStreamInQueue.end(), &player));
+  }
+  streamedNpcs[playerId].clear();
+  playerStates[playerId] = PlayerStreamState();
+  lastPassStats[playerId] = NpcStreamStats();
+}
+
+void NpcStreamer::onStreamedIn(Npc &npc, const IPlayer &player) {
+  streamedNpcs[player.getID()].emplace(&npc, Time::now());
+}
+
+void NpcStreamer::onStreamedOut(Npc &npc, const IPlayer &player) {
+  streamedNpcs[player.getID()].erase(&npc);
+}
+
+const NpcStreamer::StreamedNpcs &NpcStreamer::getStreamedNpcs(const IPlayer &player) const {
+  return streamedNpcs[player.getID()];
+}
+
+const NpcStreamStats &NpcStreamer::getLastPassStats(const IPlayer &player) const {
+  return lastPassStats[player.getID()];
+}
+
+const NpcStreamStats &NpcStreamer::getTotalStats() const {
+  return totalStats;
+}
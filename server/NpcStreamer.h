@@ -0,0 +1,171 @@
+#pragma once
+
+#include <Server/Components/Pawn/pawn.hpp>
+
+#include <Impl/pool_impl.hpp>
+
+#include "NpcWorkerPool.h"
+
+using namespace Impl;
+
+class Npc;
+
+/// Evaluations done and skipped by streaming passes
+struct NpcStreamStats {
+  uint64_t evaluated = 0;
+  uint64_t skipped = 0;
+};
+
+/// Uniform grid of npcs keyed by (virtual world, cell)
+/// Streaming looks only at the cells around a player instead of walking the whole pool
+///
+/// Streaming is incremental: a (player, npc) pair is evaluated again only when the player changes
+/// their cell, world or state, or when the npc crosses a cell boundary (z included)
+/// Moving inside of a cell does not change anything, so the stream distance is precise up to kCellSize
+///
+/// Players due to stream are collected and processed once per tick: passes are computed (in parallel if enabled)
+/// from the grid, which stays read-only meanwhile, then applied on the server thread in player id order
+class NpcStreamer {
+public:
+  static constexpr float kCellSize = 30.f;
+
+  /// Npc stream-in time and the streamed npc itself
+  using StreamedNpcs = FlatHashMap<Npc *, TimePoint>;
+
+  /// Grid bookkeeping
+  void add(Npc &npc);
+  void remove(Npc &npc);
+  void update(Npc &npc);
+  void updateMovingNpcs();
+  void clear();
+
+  /// Forces npc to be evaluated again by the next passes, e.g. when its streaming priority changes
+  void touch(Npc &npc);
+
+  /// Should be called when npc stream radius was changed
+  void updateStreamRadius(Npc &npc);
+
+  /// Max npcs streamed for a single player, the best ones by priority and distance are kept
+  /// 0 = no limit
+  void setMaxStreamedPerPlayer(size_t max);
+
+  /// Npcs are streamed in within inRadius and streamed out beyond outRadius
+  /// Npc own stream radius replaces inRadius and keeps the same out/in ratio
+  void setStreamRadii(float inRadius, float outRadius);
+
+  /// Npc can't be streamed out by distance until it's been streamed in for this long
+  void setMinResidency(Milliseconds residency);
+
+  /// Threads computing streaming passes, 0 = all of them are computed on the server thread
+  void setThreads(size_t count);
+
+  /// Every parallel pass is computed once again serially and mismatches are logged, nullptr = off
+  void setParallelVerification(ILogger *logger);
+
+  /// Max npcs streamed in for a single player per tick, the nearest ones go first, 0 = no limit
+  /// Stream outs are never delayed
+  void setStreamInsPerTick(size_t count);
+
+  /// Npcs around the player will be streamed in and out by the next processPasses()
+  void requestPass(IPlayer &player);
+  void processPasses(TimePoint now);
+
+  /// Streams in queued npcs, should be called once per tick
+  void drainStreamInQueues();
+  void removePlayer(const IPlayer &player);
+
+  /// Keeps per-player streamed sets in sync with Npc::streamedFor_
+  void onStreamedIn(Npc &npc, const IPlayer &player);
+  void onStreamedOut(Npc &npc, const IPlayer &player);
+  const StreamedNpcs &getStreamedNpcs(const IPlayer &player) const;
+
+  /// Stats of the last pass done for the player
+  const NpcStreamStats &getLastPassStats(const IPlayer &player) const;
+  /// Stats of all passes since start
+  const NpcStreamStats &getTotalStats() const;
+
+private:
+  struct Entry {
+    Npc *npc;
+    Vector3 pos; // cached to keep the cell scan on contiguous memory
+  };
+
+  struct Cell {
+    DynamicArray<Entry> entries;
+    uint64_t epoch = 0; // last time an npc entered, left or crossed a cell boundary inside of this cell
+  };
+
+  struct PlayerStreamState {
+    bool valid = false; // false until the first pass
+    bool active = false;
+    int world = 0;
+    int cellX = 0;
+    int cellY = 0;
+    int cellZ = 0;
+    uint64_t epoch = 0; // grid epoch seen by the last pass
+    bool saturated = false; // more npcs around than the budget allows
+    bool residencyPending = false; // some npcs are out of range but were kept by min residency
+  };
+
+  struct StreamPass {
+    IPlayer *player = nullptr;
+    // Player snapshot taken on the server thread
+    Vector3 pos;
+    int world = 0;
+    bool active = false;
+
+    PlayerStreamState state; // state to commit
+    NpcStreamStats stats;
+    DynamicArray<Npc *> streamIn;
+    DynamicArray<Npc *> streamOut;
+    bool budgetSelected = false; // streamIn is the whole set of npcs to stream in, not an addition
+  };
+
+  void detach(Npc &npc);
+  void invalidatePlayers();
+
+  float getStreamInRadiusSqr(const Npc &npc) const;
+  float getStreamOutRadiusSqr(const Npc &npc) const;
+  const Vector3 &getGridPosition(const Npc &npc) const;
+
+  template <typename Fn>
+  void forEachCellAround(int world, const Vector3 &pos, Fn &&fn) const;
+
+  /// Only reads the grid and the player own state, so passes of different players may run concurrently
+  void computePass(StreamPass &pass, TimePoint now) const;
+  void applyPass(StreamPass &pass);
+  void verifyPasses(TimePoint now) const;
+
+  /// Picks the best npcs within the budget, returns whether there were more candidates than the budget
+  bool selectBestNpcs(StreamPass &pass, TimePoint now) const;
+
+  static uint64_t cellKey(int world, int x, int y);
+  static int cellCoord(float value);
+
+  FlatHashMap<uint64_t, Cell> cells;
+  uint64_t epoch = 0;
+  FlatPtrHashSet<Npc> movingNpcs; // vehicle and extrapolated moves do not go through Npc, so they're refreshed every tick
+  FlatPtrHashSet<Npc> farNpcs; // npcs with stream radius larger than the cells around a player cover
+
+  size_t maxStreamedPerPlayer = 0;
+  float streamInRadius = 200.f;
+  float streamOutRadius = 200.f;
+  Milliseconds minResidency = Milliseconds(0);
+
+  StaticArray<StreamedNpcs, PLAYER_POOL_SIZE> streamedNpcs;
+  StaticArray<PlayerStreamState, PLAYER_POOL_SIZE> playerStates;
+  StaticArray<NpcStreamStats, PLAYER_POOL_SIZE> lastPassStats;
+  NpcStreamStats totalStats;
+
+  DynamicArray<IPlayer *> pendingPlayers;
+  StaticArray<bool, PLAYER_POOL_SIZE> passRequested{};
+  DynamicArray<StreamPass> passes; // kept between ticks to reuse allocations
+  NpcWorkerPool workers;
+  ILogger *verificationLogger = nullptr;
+
+  size_t streamInsPerTick = 0;
+  StaticArray<FlatPtrHashSet<Npc>, PLAYER_POOL_SIZE> streamInQueues;
+  DynamicArray<IPlayer *> playersWithStreamInQueue;
+  /// Player is in playersWithStreamInQueue, its queue may be empty already
+  StaticArray<bool, PLAYER_POOL_SIZE> streamInQueueListed{};
+};
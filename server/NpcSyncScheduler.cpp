@@ -0,0 +1,93 @@
+#include "NpcSyncScheduler.h"
+#include "Npc.h"
+
+int64_t NpcSyncScheduler::toTick(TimePoint time, bool roundUp) {
+  const auto ms = std::chrono::duration_cast<Milliseconds>(time.time_since_epoch()).count();
+  const auto slot = kSlotDuration.count();
+  return roundUp ? (ms + slot - 1) / slot : ms / slot;
+}
+
+void NpcSyncScheduler::schedule(Npc &npc, TimePoint due) {
+  if (npc.syncScheduled) {
+    if (npc.syncDue <= due) {
+      return;
+    }
+    unlink(npc);
+  }
+  npc.syncDue = due;
+  link(npc, toTick(due, true));
+}
+
+void NpcSyncScheduler::remove(Npc &npc) {
+  if (npc.syncScheduled) {
+    unlink(npc);
+  }
+}
+
+void NpcSyncScheduler::clear() {
+  for (auto &slot : slots) {
+    for (auto npc = slot; npc != nullptr;) {
+      const auto next = npc->syncNext;
+      npc->syncScheduled = false;
+      npc->syncNext = npc->syncPrev = nullptr;
+      npc = next;
+    }
+    slot = nullptr;
+  }
+  currentTick = -1;
+}
+
+void NpcSyncScheduler::collectDue(TimePoint now, DynamicArray<Npc *> &out) {
+  const auto nowTick = toTick(now, false);
+  if (currentTick == -1 || nowTick - currentTick >= static_cast<int64_t>(kSlotCount)) {
+    // Every slot is due at least once, sweep the whole wheel
+    currentTick = nowTick - static_cast<int64_t>(kSlotCount) + 1;
+  }
+
+  for (; currentTick <= nowTick; ++currentTick) {
+    auto &slot = slots[currentTick % kSlotCount];
+    auto npc = slot;
+    slot = nullptr;
+    while (npc != nullptr) {
+      const auto next = npc->syncNext;
+      npc->syncScheduled = false;
+      npc->syncNext = npc->syncPrev = nullptr;
+      if (const auto dueTick = toTick(npc->syncDue, true); dueTick <= nowTick) {
+        out.push_back(npc);
+      } else {
+        // Due in one of the next turns of the wheel
+        link(*npc, dueTick);
+      }
+      npc = next;
+    }
+  }
+}
+
+void NpcSyncScheduler::link(Npc &npc, int64_t tick) {
+  // Past due npcs go to the first slot which is not collected yet
+  if (currentTick != -1 && tick < currentTick) {
+    tick = currentTick;
+  }
+  auto &slot = slots[tick % kSlotCount];
+  npc.syncPrev = nullptr;
+  npc.syncNext = slot;
+  if (slot != nullptr) {
+    slot->syncPrev = &npc;
+  }
+  slot = &npc;
+  npc.syncSlot = tick % kSlotCount;
+  npc.syncScheduled = true;
+}
+
+void NpcSyncScheduler::unlink(Npc &npc) {
+  if (npc.syncPrev != nullptr) {
+    npc.syncPrev->syncNext = npc.syncNext;
+  } else {
+    slots[npc.syncSlot] = npc.syncNext;
+  }
+  if (npc.syncNext != nullptr) {
+    npc.syncNext->syncPrev = npc.syncPrev;
+  }
+  npc.syncNext = npc.syncPrev = nullptr;
+  npc.syncScheduled = false;
+}
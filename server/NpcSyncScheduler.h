@@ -0,0 +1,35 @@
+#pragma once
+
+#include <Impl/pool_impl.hpp>
+
+using namespace Impl;
+
+class Npc;
+
+/// Timing wheel of npcs waiting for their next allowed sync
+/// Npcs are linked into the slots intrusively, so scheduling and collecting cost O(1) per npc
+/// and a tick touches only the slots elapsed since the previous one, not the whole pool
+///
+/// Due times are rounded up to kSlotDuration, an npc is never collected before its due time
+class NpcSyncScheduler {
+public:
+  static constexpr Milliseconds kSlotDuration = Milliseconds(5);
+  static constexpr size_t kSlotCount = 256; // one turn of the wheel is 1.28 s, later npcs stay for more turns
+
+  /// Npc will be collected once due, an earlier due time replaces a later one
+  void schedule(Npc &npc, TimePoint due);
+  void remove(Npc &npc);
+  void clear();
+
+  /// Unlinks the npcs due by now and appends them to out
+  void collectDue(TimePoint now, DynamicArray<Npc *> &out);
+
+private:
+  static int64_t toTick(TimePoint time, bool roundUp);
+
+  void link(Npc &npc, int64_t tick);
+  void unlink(Npc &npc);
+
+  StaticArray<Npc *, kSlotCount> slots{};
+  int64_t currentTick = -1; // first tick not collected yet, -1 = nothing collected so far
+};
@@ -2,80 +2,76 @@
 
 #include <variant>
 
-template <int TskId>
+/// Tasks are compared through NpcTasksSet, std::variant checks the alternative index first
+/// so every operator== only sees its own type, no virtual calls or RTTI involved
+template <int TskId, typename Derived>
 struct NpcTask {
   static constexpr const int TaskId = TskId;
 
   void writeInternal(NetworkBitStream& bs) const {
     bs.writeUINT8(TaskId);
-    write(bs);
+    static_cast<const Derived&>(*this).write(bs);
   }
 
-  virtual void write(NetworkBitStream& bs) const = 0;
-  virtual bool operator==(const NpcTask& other) const = 0;
-  bool operator!=(const NpcTask& other) const {
-    return !(*this == other);
+  bool operator!=(const Derived& other) const {
+    return !(static_cast<const Derived&>(*this) == other);
   }
 };
 
-struct NpcTaskStandStill final : NpcTask<0> {
-  void write(NetworkBitStream& bs) const override {
+struct NpcTaskStandStill final : NpcTask<0, NpcTaskStandStill> {
+  void write(NetworkBitStream& bs) const {
     // Nothing to do
   }
 
-  bool operator==(const NpcTask& other) const override {
-    const auto other_ = dynamic_cast<const NpcTaskStandStill*>(&other);
-    return other_ != nullptr;
+  bool operator==(const NpcTaskStandStill& other) const {
+    return true;
   }
 };
 
-struct NpcTaskAttackPlayer final : NpcTask<1> {
+struct NpcTaskAttackPlayer final : NpcTask<1, NpcTaskAttackPlayer> {
   const IPlayer* target = nullptr;
   bool aggressive = false;
 
-  void write(NetworkBitStream& bs) const override {
+  void write(NetworkBitStream& bs) const {
     bs.writeUINT16(target->getID());
     bs.writeUINT8(aggressive ? 1 : 0);
   }
 
-  bool operator==(const NpcTask& other) const override {
-    const auto other_ = dynamic_cast<const NpcTaskAttackPlayer*>(&other);
-    return other_ != nullptr && target == other_->target && aggressive == other_->aggressive;
+  bool operator==(const NpcTaskAttackPlayer& other) const {
+    return target == other.target && aggressive == other.aggressive;
   }
 };
 
-struct NpcTaskGoToPoint final : NpcTask<2> {
+struct NpcTaskGoToPoint final : NpcTask<2, NpcTaskGoToPoint> {
   Vector3 destination;
   NpcMoveMode mode;
 
-  void write(NetworkBitStream& bs) const override {
+  void write(NetworkBitStream& bs) const {
     bs.writeVEC3(destination);
     bs.writeUINT8(int(mode));
   }
 
-  bool operator==(const NpcTask& other) const override {
-    const auto other_ = dynamic_cast<const NpcTaskGoToPoint*>(&other);
-    return other_ != nullptr && destination == other_->destination && mode == other_->mode;
+  bool operator==(const NpcTaskGoToPoint& other) const {
+    return destination == other.destination && mode == other.mode;
   }
 };
 
-struct NpcTaskFollowPlayer final : NpcTask<3> {
+struct NpcTaskFollowPlayer final : NpcTask<3, NpcTaskFollowPlayer> {
   const IPlayer* target = nullptr;
 
-  void write(NetworkBitStream& bs) const override {
+  void write(NetworkBitStream& bs) const {
     bs.writeUINT16(target->getID());
   }
 
-  bool operator==(const NpcTask& other) const override {
-    const auto other_ = dynamic_cast<const NpcTaskFollowPlayer*>(&other);
-    return other_ != nullptr && target == other_->target;
+  bool operator==(const NpcTaskFollowPlayer& other) const {
+    return target == other.target;
   }
 };
 
-struct NpcTaskPlayAnimation final : NpcTask<4> {
+struct NpcTaskPlayAnimation final : NpcTask<4, NpcTaskPlayAnimation> {
   AnimationData data;
 
-  void write(NetworkBitStream& bs) const override {
+  void write(NetworkBitStream& bs) const {
     bs.writeDynStr8(data.lib);
     bs.writeDynStr8(data.name);
     bs.writeFLOAT(data.delta);
@@ -86,36 +82,34 @@ struct NpcTaskPlayAnimation final : NpcTask<4> {
     bs.writeUINT32(data.time);
   }
 
-  bool operator==(const NpcTask& other) const override {
-    const auto other_ = dynamic_cast<const NpcTaskPlayAnimation*>(&other);
-    return other_ != nullptr
-      && data.delta == other_->data.delta
-      && data.loop == other_->data.loop
-      && data.lockX == other_->data.lockX
-      && data.lockY == other_->data.lockY
-      && data.freeze == other_->data.freeze
-      && data.time == other_->data.time
-      && data.lib == other_->data.lib
-      && data.name == other_->data.name;
+  bool operator==(const NpcTaskPlayAnimation& other) const {
+    return data.delta == other.data.delta
+      && data.loop == other.data.loop
+      && data.lockX == other.data.lockX
+      && data.lockY == other.data.lockY
+      && data.freeze == other.data.freeze
+      && data.time == other.data.time
+      && data.lib == other.data.lib
+      && data.name == other.data.name;
   }
 };
 
-struct NpcTaskAttackNpc final : NpcTask<5> {
+struct NpcTaskAttackNpc final : NpcTask<5, NpcTaskAttackNpc> {
   const INpc* target = nullptr;
   bool aggressive = false;
 
-  void write(NetworkBitStream& bs) const override {
+  void write(NetworkBitStream& bs) const {
     bs.writeUINT16(target->getID());
     bs.writeUINT8(aggressive ? 1 : 0);
   }
 
-  bool operator==(const NpcTask& other) const override {
-    const auto other_ = dynamic_cast<const NpcTaskAttackNpc*>(&other);
-    return other_ != nullptr && target == other_->target && aggressive == other_->aggressive;
+  bool operator==(const NpcTaskAttackNpc& other) const {
+    return target == other.target && aggressive == other.aggressive;
   }
 };
 
-using NpcTasksSet = std::variant<
+/// Tasks a sequence can be made of, sequences are not nested
+using NpcSequenceStep = std::variant<
     NpcTaskStandStill,
     NpcTaskAttackPlayer,
     NpcTaskGoToPoint,
@@ -123,3 +117,61 @@ using NpcTasksSet = std::variant<
     NpcTaskPlayAnimation,
     NpcTaskAttackNpc
 >;
+
+/// Steps are run one by one by clients, the sync owner reports every completed step back
+/// Each step is written with its size, so clients keep the bytes and run them later
+struct NpcTaskSequence final : NpcTask<6, NpcTaskSequence> {
+  static constexpr size_t kMaxSteps = 255;
+
+  DynamicArray<NpcSequenceStep> steps;
+  bool loop = false;
+  uint16_t repeat = 1; ///< times the steps are run, if not looped
+
+  // Progress, not a part of the task identity
+  uint8_t step = 0;
+  uint16_t pass = 0;
+
+  void write(NetworkBitStream& bs) const {
+    bs.writeUINT8(static_cast<uint8_t>(steps.size()));
+    for (const auto &step_ : steps) {
+      NetworkBitStream stepBs;
+      std::visit([&stepBs](const auto &task) { task.writeInternal(stepBs); }, step_);
+      bs.writeUINT16(static_cast<uint16_t>(stepBs.GetNumberOfBytesUsed()));
+      bs.WriteBits(stepBs.GetData(), stepBs.GetNumberOfBitsUsed(), false);
+    }
+    bs.writeUINT8(loop ? 1 : 0);
+    bs.writeUINT16(repeat);
+    bs.writeUINT8(step);
+    bs.writeUINT16(pass);
+  }
+
+  /// Moves past the completed step, false once the last pass is done
+  bool advance() {
+    if (++step < steps.size()) {
+      return true;
+    }
+    step = 0;
+    ++pass;
+    return loop || pass < repeat;
+  }
+
+  bool operator==(const NpcTaskSequence& other) const {
+    return loop == other.loop && repeat == other.repeat && steps == other.steps;
+  }
+};
+
+using NpcTasksSet = std::variant<
+    NpcTaskStandStill,
+    NpcTaskAttackPlayer,
+    NpcTaskGoToPoint,
+    NpcTaskFollowPlayer,
+    NpcTaskPlayAnimation,
+    NpcTaskAttackNpc,
+    NpcTaskSequence
+>;
+
+/// Animations and sequences end on clients by themselves, or are broken by a stun, while still being current here
+/// Equal ones are not duplicates then, issuing them again starts them over
+inline bool isTaskRestartable(const NpcTasksSet &task) {
+  return std::holds_alternative<NpcTaskPlayAnimation>(task) || std::holds_alternative<NpcTaskSequence>(task);
+}
@@ -0,0 +1,83 @@
+#include "NpcWorkerPool.h"
+
+NpcWorkerPool::~NpcWorkerPool() {
+  stop();
+}
+
+void NpcWorkerPool::start(size_t threadsCount) {
+  stop();
+  stopping = false;
+  threads.reserve(threadsCount);
+  for (size_t i = 0; i < threadsCount; ++i) {
+    threads.emplace_back(&NpcWorkerPool::run, this, generation);
+  }
+}
+
+void NpcWorkerPool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  threads.clear();
+}
+
+size_t NpcWorkerPool::size() const {
+  return threads.size();
+}
+
+void NpcWorkerPool::parallelFor(size_t count, const std::function<void(size_t)> &fn) {
+  if (threads.empty() || count <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      fn(i);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &fn;
+    jobSize = count;
+    nextIndex = 0;
+    busy = threads.size();
+    ++generation;
+  }
+  wake.notify_all();
+
+  work(fn, count);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this] { return busy == 0; });
+  job = nullptr;
+}
+
+void NpcWorkerPool::run(uint64_t seenGeneration) {
+  // Generation is taken at start, a job posted before this thread got the lock is not missed
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+    if (stopping) {
+      return;
+    }
+    seenGeneration = generation;
+    const auto fn = job;
+    const auto count = jobSize;
+
+    lock.unlock();
+    work(*fn, count);
+    lock.lock();
+
+    if (--busy == 0) {
+      done.notify_one();
+    }
+  }
+}
+
+void NpcWorkerPool::work(const std::function<void(size_t)> &fn, size_t count) {
+  for (auto i = nextIndex++; i < count; i = nextIndex++) {
+    fn(i);
+  }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Fixed set of threads running index-based jobs
+/// Jobs must not touch anything the other indices write to
+class NpcWorkerPool {
+public:
+  ~NpcWorkerPool();
+
+  /// Restarts the pool with the given amount of threads, 0 = every job runs on the calling thread
+  void start(size_t threadsCount);
+  void stop();
+  size_t size() const;
+
+  /// Runs fn(i) for every i in [0, count), the calling thread takes part as well
+  /// Returns once every index is done
+  void parallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+private:
+  void run(uint64_t seenGeneration);
+  void work(const std::function<void(size_t)> &fn, size_t count);
+
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+
+  const std::function<void(size_t)> *job = nullptr;
+  size_t jobSize = 0;
+  uint64_t generation = 0;
+  size_t busy = 0; // threads which have not finished the current job yet
+  bool stopping = false;
+  std::atomic<size_t> nextIndex{0};
+};
@@ -217,8 +217,35 @@ SCRIPT_API(TaskNpcPlayAnimation, bool(INpc &npc, const std::string& animlib, con
 
 ///////////////
 
-SCRIPT_API(SetNpcReliablePlayer, bool(INpc &npc, const IPlayer* player)) {
-  npc.SetReliablePlayerForSync(player);
+SCRIPT_API(BeginNpcTaskSequence, bool(INpc &npc)) {
+  npc.beginTaskSequence();
+  return true;
+}
+
+SCRIPT_API(TaskNpcSequence, bool(INpc &npc, bool loop, int repeat)) {
+  return npc.runTaskSequence(loop, repeat);
+}
+
+SCRIPT_API(GetNpcTaskSequenceStep, int(INpc &npc)) {
+  return npc.getTaskSequenceStep();
+}
+
+///////////////
+
+SCRIPT_API(BeginNpcUpdate, bool(INpc &npc)) {
+  npc.beginUpdate();
+  return true;
+}
+
+SCRIPT_API(CommitNpcUpdate, bool(INpc &npc)) {
+  npc.commitUpdate();
+  return true;
+}
+
+///////////////
+
+SCRIPT_API(SetNpcReliablePlayer, bool(INpc &npc, IPlayer* player)) {
+  npc.setReliablePlayerForSync(player);
   return true;
 }
 
@@ -229,6 +256,99 @@ SCRIPT_API_FAILRET(GetNpcReliablePlayer, INVALID_PLAYER_ID, int(INpc &npc)) {
 
 ///////////////
 
+SCRIPT_API(SetNpcStreamPriority, bool(INpc &npc, int priority)) {
+  npc.setStreamPriority(priority);
+  return true;
+}
+
+SCRIPT_API(GetNpcStreamPriority, int(INpc &npc)) {
+  return npc.getStreamPriority();
+}
+
+SCRIPT_API(SetNpcStreamRadius, bool(INpc &npc, float radius)) {
+  if (radius < 0.f) {
+    return false;
+  }
+  npc.setStreamRadius(radius);
+  return true;
+}
+
+SCRIPT_API(GetNpcStreamRadius, bool(INpc &npc, float &radius)) {
+  radius = npc.getStreamRadius();
+  return true;
+}
+
+SCRIPT_API(GetPlayerNpcStreamStats, bool(IPlayer &player, int &evaluated, int &skipped)) {
+  const auto &stats = NpcComponent::instance().getStreamer().getLastPassStats(player);
+  evaluated = static_cast<int>(stats.evaluated);
+  skipped = static_cast<int>(stats.skipped);
+  return true;
+}
+
+SCRIPT_API(GetNpcStreamStats, bool(int &evaluated, int &skipped)) {
+  const auto &stats = NpcComponent::instance().getStreamer().getTotalStats();
+  evaluated = static_cast<int>(std::min<uint64_t>(stats.evaluated, INT_MAX));
+  skipped = static_cast<int>(std::min<uint64_t>(stats.skipped, INT_MAX));
+  return true;
+}
+
+SCRIPT_API(SetNpcPlayerBandwidthBudget, bool(int bytesPerSecond)) {
+  if (bytesPerSecond < 0) {
+    return false;
+  }
+  NpcComponent::instance().getBandwidthBudget().setBytesPerSecond(bytesPerSecond);
+  return true;
+}
+
+SCRIPT_API(GetNpcPlayerBandwidthBudget, int()) {
+  return NpcComponent::instance().getBandwidthBudget().getBytesPerSecond();
+}
+
+SCRIPT_API(GetPlayerNpcBandwidthUsage, bool(IPlayer &player, int &bytesLastSecond, int &deferredLastSecond)) {
+  const auto usage = NpcComponent::instance().getBandwidthBudget().getUsage(player, Time::now());
+  bytesLastSecond = static_cast<int>(std::min<uint64_t>(usage.bytes, INT_MAX));
+  deferredLastSecond = static_cast<int>(std::min<uint64_t>(usage.deferred, INT_MAX));
+  return true;
+}
+
+SCRIPT_API(GetPlayerNpcSyncOwnership, bool(IPlayer &player, int &ownedNpcs, int &clientLoad)) {
+  ownedNpcs = NpcComponent::instance().getOwnedNpcsCount(player);
+  clientLoad = NpcComponent::instance().getPlayerLoad(player);
+  return true;
+}
+
+SCRIPT_API(GetPlayerNpcSyncCorrections, bool(IPlayer &player, int &rejected, int &corrections)) {
+  const auto &stats = NpcComponent::instance().getCorrectionStats(player);
+  rejected = static_cast<int>(std::min<uint64_t>(stats.rejected, INT_MAX));
+  corrections = static_cast<int>(std::min<uint64_t>(stats.corrections, INT_MAX));
+  return true;
+}
+
+SCRIPT_API(GetNpcSyncValidationStats, bool(int &validated, int &rejected, int &averageNanoseconds)) {
+  const auto &stats = NpcComponent::instance().getValidationStats();
+  validated = static_cast<int>(std::min<uint64_t>(stats.validated, INT_MAX));
+  rejected = static_cast<int>(std::min<uint64_t>(stats.rejected, INT_MAX));
+  averageNanoseconds = stats.validated != 0 ? static_cast<int>(stats.time.count() / static_cast<int64_t>(stats.validated)) : 0;
+  return true;
+}
+
+SCRIPT_API(GetNpcEncodeStats, bool(int &hits, int &misses, int &bytesEncodedLastTick)) {
+  const auto &total = NpcComponent::instance().getTotalEncodeStats();
+  hits = static_cast<int>(std::min<uint64_t>(total.hits, INT_MAX));
+  misses = static_cast<int>(std::min<uint64_t>(total.misses, INT_MAX));
+  bytesEncodedLastTick = static_cast<int>(std::min<uint64_t>(NpcComponent::instance().getLastTickEncodeStats().bytesEncoded, INT_MAX));
+  return true;
+}
+
+SCRIPT_API(GetNpcTaskUpdateStats, bool(int &sent, int &suppressed)) {
+  const auto &stats = NpcComponent::instance().getTaskUpdateStats();
+  sent = static_cast<int>(std::min<uint64_t>(stats.sent, INT_MAX));
+  suppressed = static_cast<int>(std::min<uint64_t>(stats.suppressed, INT_MAX));
+  return true;
+}
+
+///////////////
+
 // Npcs param lookup
 namespace pawn_natives {
 #define CUSTOM_POOL_PARAM(type)                             \
@@ -0,0 +1,61 @@
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+
+#include "NpcMovementValidator.h"
+
+// Prints the rejection rates and the cost of a check, run it from a release build
+// Only the rates are asserted, timings depend on the machine
+int main() {
+  static constexpr float kRunSpeed = 7.f;
+  static constexpr int kPackets = 500;
+  static constexpr int kChecks = 10000000;
+  static constexpr auto kSyncInterval = Milliseconds(40);
+  const auto step = std::chrono::duration<float>(kSyncInterval).count();
+
+  NpcMovementValidator validator;
+  auto now = TimePoint(Milliseconds(100000));
+  auto pos = Vector3(0.f, 0.f, 3.f);
+  validator.reset(pos, now);
+  auto lastAccepted = pos;
+
+  auto rejected = 0;
+  for (int i = 0; i < kPackets; ++i) {
+    now += kSyncInterval;
+    pos.x += 6.f * step;
+    if (validator.validate(pos, now, kRunSpeed)) {
+      validator.push(pos, now);
+      lastAccepted = pos;
+    } else {
+      ++rejected;
+    }
+  }
+  std::printf("6 m/s run: %d of %d syncs rejected\n", rejected, kPackets);
+  assert(rejected == 0);
+
+  rejected = 0;
+  for (int i = 0; i < kPackets; ++i) {
+    now += kSyncInterval;
+    pos.x += 12.f * step;
+    if (validator.validate(pos, now, kRunSpeed)) {
+      validator.push(pos, now);
+      lastAccepted = pos;
+    } else {
+      ++rejected;
+    }
+  }
+  std::printf("12 m/s speed hack: %d of %d syncs rejected\n", rejected, kPackets);
+  assert(rejected > kPackets * 9 / 10);
+
+  // The history is full now, which is the most expensive case
+  now += kSyncInterval;
+  auto accepted = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kChecks; ++i) {
+    const auto candidate = Vector3(lastAccepted.x + (i & 7) * 0.01f, lastAccepted.y, lastAccepted.z);
+    accepted += validator.validate(candidate, now, kRunSpeed);
+  }
+  const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  std::printf("%.1f ns per check (%d accepted)\n", elapsed / kChecks, accepted);
+  return 0;
+}
@@ -0,0 +1,84 @@
+#undef NDEBUG
+#include <cassert>
+
+#include "NpcMovementValidator.h"
+
+namespace {
+constexpr float kRunSpeed = 7.f;
+constexpr auto kSyncInterval = Milliseconds(40);
+
+/// Runs along x at speed m/s, returns the last accepted position
+Vector3 run(NpcMovementValidator &validator, Vector3 pos, TimePoint &now, float speed, int packets) {
+  for (int i = 0; i < packets; ++i) {
+    now += kSyncInterval;
+    pos.x += speed * std::chrono::duration<float>(kSyncInterval).count();
+    assert(validator.validate(pos, now, kRunSpeed));
+    validator.push(pos, now);
+  }
+  return pos;
+}
+
+void testSteadyRun() {
+  NpcMovementValidator validator;
+  auto now = TimePoint(Milliseconds(100000));
+  validator.reset(Vector3(0.f, 0.f, 3.f), now);
+  run(validator, Vector3(0.f, 0.f, 3.f), now, 6.f, 500);
+}
+
+void testSpeedHack() {
+  NpcMovementValidator validator;
+  auto now = TimePoint(Milliseconds(100000));
+  auto pos = Vector3(0.f, 0.f, 3.f);
+  validator.reset(pos, now);
+  pos = run(validator, pos, now, 6.f, 50);
+
+  auto rejected = 0;
+  for (int i = 0; i < 100; ++i) {
+    now += kSyncInterval;
+    pos.x += 12.f * std::chrono::duration<float>(kSyncInterval).count();
+    if (validator.validate(pos, now, kRunSpeed)) {
+      validator.push(pos, now);
+    } else {
+      ++rejected;
+    }
+  }
+  // The slack lets the first packets through, after that the window catches up
+  assert(rejected > 80);
+}
+
+void testFirstSyncAfterConstruction() {
+  NpcMovementValidator validator;
+  const auto spawn = Vector3(100.f, 100.f, 3.f);
+  auto now = TimePoint(Milliseconds(100000));
+  validator.reset(spawn, now);
+
+  now += kSyncInterval;
+  assert(!validator.validate(Vector3(200.f, 100.f, 3.f), now, kRunSpeed));
+  assert(validator.validate(Vector3(100.2f, 100.f, 3.f), now, kRunSpeed));
+}
+
+void testFirstSyncAfterTeleport() {
+  NpcMovementValidator validator;
+  auto now = TimePoint(Milliseconds(100000));
+  auto pos = Vector3(0.f, 0.f, 3.f);
+  validator.reset(pos, now);
+  pos = run(validator, pos, now, 6.f, 50);
+
+  // SetNpcPos, the old history is gone and the server position is the only reference
+  const auto teleport = Vector3(1000.f, 1000.f, 10.f);
+  validator.reset(teleport, now);
+  now += kSyncInterval;
+  assert(!validator.validate(Vector3(1100.f, 1000.f, 10.f), now, kRunSpeed));
+  // Neither is a client still reporting the position before the teleport
+  assert(!validator.validate(pos, now, kRunSpeed));
+  assert(validator.validate(Vector3(1000.2f, 1000.f, 10.f), now, kRunSpeed));
+}
+}
+
+int main() {
+  testSteadyRun();
+  testSpeedHack();
+  testFirstSyncAfterConstruction();
+  testFirstSyncAfterTeleport();
+  return 0;
+}
@@ -0,0 +1,110 @@
+#undef NDEBUG
+#include <cassert>
+#include <cmath>
+#include <initializer_list>
+#include <limits>
+
+#include <NpcSyncQuantization.hpp>
+
+namespace {
+using Q = NpcSyncQuantization;
+
+constexpr float kPositionError = 0.5f / Q::kPositionScale;
+constexpr float kHeadingError = 0.5f / Q::kHeadingScale;
+constexpr float kNaN = std::numeric_limits<float>::quiet_NaN();
+constexpr float kInfinity = std::numeric_limits<float>::infinity();
+
+/// Through the bytes written to the wire, as both sides read them
+float roundTripAxis(float value) {
+  const auto quantized = Q::quantizeAxis(value);
+  return Q::dequantizeAxis(Q::joinAxis(Q::axisCell(quantized), Q::axisOffset(quantized)));
+}
+
+void testAxisEveryStep() {
+  const auto limit = Q::quantizeAxis(Q::kPositionLimit);
+  assert(limit == static_cast<int32_t>(Q::kPositionLimit * Q::kPositionScale));
+  assert(Q::quantizeAxis(-Q::kPositionLimit) == -limit);
+  // Every value on the wire decodes to a position which is encoded back to it
+  for (auto value = -limit; value <= limit; ++value) {
+    const auto cell = Q::axisCell(value);
+    const auto offset = Q::axisOffset(value);
+    assert(Q::joinAxis(cell, offset) == value);
+    assert(Q::quantizeAxis(Q::dequantizeAxis(value)) == value);
+  }
+  // 24 bits are enough, the cell is sign extended
+  assert(Q::axisCell(limit) == 127 && Q::axisCell(-limit) == -128);
+  assert(Q::axisCell(-1) == -1 && Q::axisOffset(-1) == 0xFFFF);
+}
+
+void testAxisError() {
+  for (auto value = -Q::kPositionLimit; value <= Q::kPositionLimit; value += 0.737f) {
+    assert(std::fabs(roundTripAxis(value) - value) <= kPositionError);
+  }
+  for (auto value : {0.f, -0.f, 0.001f, -0.001f, 1234.567f, -2999.999f, 255.999f, -256.f, -256.001f}) {
+    assert(std::fabs(roundTripAxis(value) - value) <= kPositionError);
+  }
+  // Halves are rounded away from zero on both sides of it
+  assert(Q::quantizeAxis(0.5f / Q::kPositionScale) == 1);
+  assert(Q::quantizeAxis(-0.5f / Q::kPositionScale) == -1);
+  // Just below a half, float addition would round the sum up to the next step
+  assert(Q::round(0.49999997f) == 0 && Q::round(-0.49999997f) == 0);
+}
+
+void testAxisClamp() {
+  assert(roundTripAxis(40000.f) == Q::kPositionLimit);
+  assert(roundTripAxis(-40000.f) == -Q::kPositionLimit);
+  assert(roundTripAxis(kInfinity) == Q::kPositionLimit);
+  assert(roundTripAxis(-kInfinity) == -Q::kPositionLimit);
+  assert(roundTripAxis(kNaN) == 0.f);
+}
+
+void testHeading() {
+  for (uint32_t value = 0; value <= 0xFFFF; ++value) {
+    const auto heading = Q::dequantizeHeading(static_cast<uint16_t>(value));
+    assert(heading >= 0.f && heading < 360.f);
+    assert(Q::quantizeHeading(heading) == value);
+  }
+  for (auto heading = 0.f; heading < 360.f; heading += 0.113f) {
+    const auto decoded = Q::dequantizeHeading(Q::quantizeHeading(heading));
+    // The top half step wraps to 0
+    const auto error = std::fmin(std::fabs(decoded - heading), std::fabs(decoded + 360.f - heading));
+    assert(error <= kHeadingError);
+    // Full turns either way end up on the same value
+    for (auto turns : {-3.f, -1.f, 1.f, 3.f}) {
+      const auto wrapped = Q::quantizeHeading(heading + turns * 360.f);
+      const auto diff = (wrapped - Q::quantizeHeading(heading) + 0x10000) & 0xFFFF;
+      assert(diff <= 1 || diff == 0xFFFF); // float precision of the turned heading
+    }
+  }
+  assert(Q::quantizeHeading(360.f) == 0);
+  assert(Q::quantizeHeading(-90.f) == Q::quantizeHeading(270.f));
+  assert(Q::quantizeHeading(-0.001f) == 0);
+  assert(Q::quantizeHeading(-1.f / Q::kHeadingScale) == 0xFFFF);
+  assert(Q::quantizeHeading(kNaN) == 0);
+  assert(Q::quantizeHeading(kInfinity) == 0);
+  assert(Q::quantizeHeading(1e12f) == 0);
+}
+
+void testVelocity() {
+  for (int32_t value = -0x7FFF; value <= 0x7FFF; ++value) {
+    const auto velocity = Q::dequantizeVelocity(static_cast<int16_t>(value));
+    assert(Q::quantizeVelocity(velocity) == value);
+    // Sent as uint16, read back as int16
+    assert(static_cast<int16_t>(static_cast<uint16_t>(Q::quantizeVelocity(velocity))) == value);
+  }
+  assert(Q::quantizeVelocity(200.f) == 0x7FFF);
+  assert(Q::quantizeVelocity(-200.f) == -0x7FFF);
+  assert(Q::quantizeVelocity(kInfinity) == 0x7FFF);
+  assert(Q::quantizeVelocity(kNaN) == 0);
+  assert(std::fabs(Q::dequantizeVelocity(Q::quantizeVelocity(-6.789f)) + 6.789f) <= 0.5f / Q::kVelocityScale);
+}
+}
+
+int main() {
+  testAxisEveryStep();
+  testAxisError();
+  testAxisClamp();
+  testHeading();
+  testVelocity();
+  return 0;
+}
@@ -0,0 +1,64 @@
+#undef NDEBUG
+#include <cassert>
+
+#include "Npc.h"
+
+namespace {
+NpcTaskGoToPoint makeGoTo(Vector3 destination) {
+  NpcTaskGoToPoint task;
+  task.destination = destination;
+  task.mode = NpcMoveMode_Walk;
+  return task;
+}
+
+NpcTaskSequence makePatrol() {
+  NpcTaskSequence sequence;
+  sequence.steps.emplace_back(makeGoTo(Vector3(10.f, 0.f, 3.f)));
+  sequence.steps.emplace_back(makeGoTo(Vector3(0.f, 10.f, 3.f)));
+  return sequence;
+}
+
+void testPlainTasksAreDeduplicated() {
+  const NpcTasksSet goTo = makeGoTo(Vector3(10.f, 0.f, 3.f));
+  assert(goTo == NpcTasksSet(makeGoTo(Vector3(10.f, 0.f, 3.f))));
+  assert(goTo != NpcTasksSet(makeGoTo(Vector3(0.f, 10.f, 3.f))));
+  assert(!isTaskRestartable(goTo));
+  assert(!isTaskRestartable(NpcTaskStandStill()));
+}
+
+void testAnimationIsRestartable() {
+  NpcTaskPlayAnimation animation;
+  animation.data.loop = true;
+  assert(isTaskRestartable(animation));
+}
+
+void testSequenceIssuedAgain() {
+  NpcTasksSet active = makePatrol();
+  auto &running = std::get<NpcTaskSequence>(active);
+  const NpcTasksSet again = makePatrol();
+
+  // Mid run: progress is not a part of the identity, still the same sequence is not a duplicate
+  assert(running.advance());
+  assert(active == again);
+  assert(isTaskRestartable(again));
+  // The one given again starts from the first step
+  assert(std::get<NpcTaskSequence>(again).step == 0 && std::get<NpcTaskSequence>(again).pass == 0);
+
+  // Finished, the clients stand still while the server may not have heard of it yet
+  assert(!running.advance());
+  assert(active == again);
+  assert(isTaskRestartable(again));
+
+  // A different sequence is a new task anyway
+  auto longer = makePatrol();
+  longer.steps.emplace_back(makeGoTo(Vector3(0.f, 0.f, 3.f)));
+  assert(active != NpcTasksSet(longer));
+}
+}
+
+int main() {
+  testPlainTasksAreDeduplicated();
+  testAnimationIsRestartable();
+  testSequenceIssuedAgain();
+  return 0;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+
+/// Fixed point encoding of the npc sync, the server and the client both use it so they round the same way
+/// Position axis is 24 bits: a signed byte picks a 256 m cell and 16 bits point inside of it in 1/256 m steps
+/// It covers +-32 km with 2 mm max error, positions beyond are clamped
+/// Heading is 16 bits, 0.0055 degrees max error, velocity is 16 bits per axis
+/// Nothing but the standard library is included, see server/tests/NpcSyncQuantizationTest.cpp
+struct NpcSyncQuantization {
+  static constexpr float kPositionScale = 256.f;
+  static constexpr float kPositionLimit = 32767.f;
+  static constexpr float kHeadingScale = 65536.f / 360.f;
+  static constexpr float kHeadingLimit = 1e9f; ///< degrees, anything beyond is not a heading
+  static constexpr float kVelocityScale = 256.f; ///< +-128 m/s
+  static constexpr float kVelocityLimit = 32767.f / kVelocityScale;
+
+  /// Halves are rounded away from zero, NaN is 0
+  /// The sum is exact in double, so x87 and SSE builds round the same way
+  static constexpr int32_t round(float value) {
+    return value == value ? static_cast<int32_t>(static_cast<double>(value) + (value >= 0.f ? 0.5 : -0.5)) : 0;
+  }
+
+  static constexpr float clamp(float value, float limit) {
+    return value < -limit ? -limit : (value > limit ? limit : value);
+  }
+
+  static constexpr int32_t quantizeAxis(float value) {
+    return round(clamp(value, kPositionLimit) * kPositionScale);
+  }
+
+  static constexpr float dequantizeAxis(int32_t value) {
+    return static_cast<float>(value) / kPositionScale;
+  }
+
+  /// Upper 8 bits of a quantized axis, sign included
+  static constexpr int8_t axisCell(int32_t value) {
+    return static_cast<int8_t>(value >> 16);
+  }
+
+  static constexpr uint16_t axisOffset(int32_t value) {
+    return static_cast<uint16_t>(value & 0xFFFF);
+  }
+
+  static constexpr int32_t joinAxis(int8_t cell, uint16_t offset) {
+    return static_cast<int32_t>(cell) * 65536 + offset;
+  }
+
+  static constexpr uint16_t quantizeHeading(float heading) {
+    // Wraps around, so 360 degrees is 0 and -90 is 270
+    if (!(heading >= -kHeadingLimit && heading <= kHeadingLimit)) {
+      return 0;
+    }
+    const auto value = static_cast<double>(heading) * kHeadingScale;
+    return static_cast<uint16_t>(static_cast<int64_t>(value + (value >= 0. ? 0.5 : -0.5)) & 0xFFFF);
+  }
+
+  static constexpr float dequantizeHeading(uint16_t heading) {
+    return static_cast<float>(heading) / kHeadingScale;
+  }
+
+  static constexpr int16_t quantizeVelocity(float value) {
+    return static_cast<int16_t>(round(clamp(value, kVelocityLimit) * kVelocityScale));
+  }
+
+  static constexpr float dequantizeVelocity(int16_t value) {
+    return static_cast<float>(value) / kVelocityScale;
+  }
+};